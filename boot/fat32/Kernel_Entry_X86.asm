@@ -6,8 +6,8 @@ _start:
 	;We disable interrupts, we have no IDT installed
 	cli
     
-	; Place the vboot header into first argument for kMain
-	mov rcx, rbx
+	; Place the boot info header into first argument for kMain (SysV: rdi)
+	mov rdi, rbx
 
 	call kMain
 	mov rax, 0x000000000000DEAD
@@ -2,9 +2,10 @@
 ; General x86 Real Mode Memory Map:
 ;   - 0x00000000 - 0x000003FF - Real Mode Interrupt Vector Table
 ;   - 0x00000400 - 0x000004FF - BIOS Data Area
-;   - 0x00000500 - 0x00007BFF - Kernel
+;   - 0x00005000 - 0x00005FFF - Boot Info (E820 Memory Map)
 ;   - 0x00007C00 - 0x00007DFF - Stage 1 (512 Bytes)
-;   - 0x00007E00 - 0x0009FFFF - Stage 2
+;   - 0x00007E00 - 0x0000FFFF - Stage 2
+;   - 0x00010000 - 0x0007FFFF - Kernel (before it is moved to 1MB)
 ;   - 0x000A0000 - 0x000BFFFF - Video RAM (VRAM) Memory
 ;   - 0x000B0000 - 0x000B7777 - Monochrome Video Memory
 ;   - 0x000B8000 - 0x000BFFFF - Color Video Memory
@@ -33,6 +34,7 @@ jmp Stage2_Entry
 %include "../includes/Gdt.inc"
 %include "../includes/Idt.inc"
 %include "../includes/A20.inc"
+%include "../includes/MemoryMap.inc"
 
 ;*******************************************************
 ;	Data Section
@@ -44,6 +46,7 @@ jmp Stage2_Entry
 ;
 ;		-Store BIOS information
 ;		-Load Kernel
+;		-Collect the E820 memory map
 ;		-Install GDT; go into protected mode (pmode)
 ;		-Jump to Stage 3
 ;*******************************************************
@@ -143,10 +146,11 @@ FixCS:
 LoadFile:
 	push di
 	; Lets load the fuck out of this file
-	; Step 1. Setup buffer
-	mov 	bx, 0x0000
+	; Step 1. Setup buffer, the kernel can grow past 64KB as ReadSector
+	; moves ES along
+	mov 	bx, KERNEL_BASE_ADDRESS >> 4
 	mov 	es, bx
-	mov 	bx, 0x500
+	xor 	bx, bx
 
 	; Load
 	.cLoop:
@@ -351,6 +355,12 @@ SetA20:
 	;-------------------------------;
     call    EnableA20_KKbrd_Out
 
+GetMemMap:
+    ;-------------------------------;
+	;   Collect E820 Memory Map     ;
+	;-------------------------------;
+    call    GetMemoryMap
+
 SetVideoMode:
     ;-------------------------------;
 	;   Set Video Mode  	        ;
@@ -405,8 +415,8 @@ LoaderEntry32:
 	mov ss, ax
 	mov gs, ax
     
-	; Copy kernel from 0x500 to 0x100000 (1MB mark)
-	mov esi, 0x00000500
+	; Copy kernel from 0x10000 to 0x100000 (1MB mark)
+	mov esi, KERNEL_BASE_ADDRESS
 	mov edi, 0x00100000
 	mov ecx, dword [KernelSize]
 	rep movsb
@@ -506,6 +516,8 @@ LoaderEntry64:
 
 
 Continue_Part3:
+	; Hand the boot info block to the kernel
+	mov rbx, BOOTINFO_ADDRESS
 	jmp 0x100000
 
 DAP:
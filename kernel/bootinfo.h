@@ -0,0 +1,32 @@
+#ifndef __BOOTINFO_H__
+#define __BOOTINFO_H__
+
+#include <stdint.h>
+
+// Must match boot/includes/GlobalDefines.inc and MemoryMap.inc
+#define BOOTINFO_MAGIC 0x494E4352
+
+#define E820_TYPE_USABLE       1
+#define E820_TYPE_RESERVED     2
+#define E820_TYPE_ACPI_RECLAIM 3
+#define E820_TYPE_ACPI_NVS     4
+#define E820_TYPE_BAD          5
+
+// ACPI 3.0 extended attribute: entry should be ignored when clear
+#define E820_ATTR_VALID (1 << 0)
+
+typedef struct __attribute__((packed)) e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t attributes;
+} e820_entry_t;
+
+// Handed over by Stage2 in RBX
+typedef struct __attribute__((packed)) boot_info {
+    uint32_t magic;
+    uint32_t mmap_count;
+    uint64_t mmap_addr;
+} boot_info_t;
+
+#endif // __BOOTINFO_H__
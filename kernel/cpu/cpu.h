@@ -0,0 +1,85 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_CPUS        8
+#define CACHE_LINE_SIZE 64
+
+#define RFLAGS_IF (1 << 9)
+
+#define CPUID_FEATURES          0x00000001
+#define CPUID_ECX_PCID          (1 << 17)  // process-context identifiers
+#define CPUID_EDX_PGE           (1 << 13)  // global pages
+
+#define CPUID_EXT_FEATURES      0x80000001
+#define CPUID_EXT_EDX_PDPE1GB   (1 << 26)  // 1 GB pages
+
+// Only the bootstrap processor runs until SMP bring-up exists
+static inline uint32_t cpu_current_id(void) {
+    return 0;
+}
+
+// Disables interrupts and returns the previous RFLAGS for cpu_irq_restore
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+static inline uint64_t cpu_read_cr2(void) {
+    uint64_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
+// Stops this CPU for good
+static inline __attribute__((noreturn)) void cpu_halt(void) {
+    for (;;) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax,
+                             uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static inline bool cpu_has_pcid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    return (ecx & CPUID_ECX_PCID) != 0;
+}
+
+static inline bool cpu_has_global_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_EDX_PGE) != 0;
+}
+
+static inline bool cpu_has_1gb_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < CPUID_EXT_FEATURES) {
+        return false;
+    }
+    cpu_cpuid(CPUID_EXT_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_EXT_EDX_PDPE1GB) != 0;
+}
+
+#endif // __CPU_H__
@@ -0,0 +1,113 @@
+#include "idt.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+#define IDT_GATE_INTERRUPT 0x8E    // present, DPL 0, 64-bit interrupt gate
+
+typedef struct __attribute__((packed)) idt_entry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t zero;
+} idt_entry_t;
+
+typedef struct __attribute__((packed)) idt_pointer {
+    uint16_t limit;
+    uint64_t base;
+} idt_pointer_t;
+
+// Entry points of the exception stubs, from isr.asm
+extern uint64_t isr_stub_table[EXCEPTION_COUNT];
+
+static idt_entry_t idt[IDT_ENTRIES] __attribute__((aligned(16)));
+static interrupt_handler_t handlers[IDT_ENTRIES];
+
+static const char* exception_names[EXCEPTION_COUNT] = {
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "BOUND range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack-segment fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating-point error", "Alignment check", "Machine check", "SIMD floating-point error",
+    "Virtualization exception", "Control protection exception", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection exception", "VMM communication exception", "Security exception", "Reserved",
+};
+
+static void set_gate(uint8_t vector, uint64_t handler, uint16_t selector) {
+    idt_entry_t* entry = &idt[vector];
+    entry->offset_low = handler & 0xFFFF;
+    entry->selector = selector;
+    entry->ist = 0;
+    entry->type_attr = IDT_GATE_INTERRUPT;
+    entry->offset_mid = (handler >> 16) & 0xFFFF;
+    entry->offset_high = (handler >> 32) & 0xFFFFFFFF;
+    entry->zero = 0;
+}
+
+void idt_init(void) {
+    // Whatever 64-bit code selector Stage2 left us on
+    uint16_t selector;
+    __asm__ volatile("mov %%cs, %0" : "=r"(selector));
+
+    for (uint32_t i = 0; i < IDT_ENTRIES; i++) {
+        idt[i].offset_low = 0;
+        idt[i].selector = 0;
+        idt[i].ist = 0;
+        idt[i].type_attr = 0;
+        idt[i].offset_mid = 0;
+        idt[i].offset_high = 0;
+        idt[i].zero = 0;
+        handlers[i] = NULL;
+    }
+    for (uint8_t i = 0; i < EXCEPTION_COUNT; i++) {
+        set_gate(i, isr_stub_table[i], selector);
+    }
+
+    idt_pointer_t pointer;
+    pointer.limit = sizeof(idt) - 1;
+    pointer.base = (uint64_t)idt;
+    __asm__ volatile("lidt %0" :: "m"(pointer));
+
+    serial_writestring("[IDT] Exception handlers installed\n");
+}
+
+void idt_set_handler(uint8_t vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+void idt_fatal(const char* reason, interrupt_frame_t* frame) {
+    serial_writestring("\n[CPU] ");
+    serial_writestring(reason);
+    if (frame->vector < EXCEPTION_COUNT) {
+        serial_writestring(" (");
+        serial_writestring(exception_names[frame->vector]);
+        serial_writestring(")");
+    }
+    serial_writestring("\n[CPU] vector ");
+    serial_writedec(frame->vector);
+    serial_writestring(" error ");
+    serial_writehex(frame->error_code);
+    serial_writestring(" rip ");
+    serial_writehex(frame->rip);
+    serial_writestring(" rsp ");
+    serial_writehex(frame->rsp);
+    if (frame->vector == VECTOR_PAGE_FAULT) {
+        serial_writestring(" cr2 ");
+        serial_writehex(cpu_read_cr2());
+    }
+    serial_writestring("\n[CPU] System halted\n");
+
+    cpu_halt();
+}
+
+// Called from isr_common with the frame it built on the stack
+void isr_dispatch(interrupt_frame_t* frame) {
+    interrupt_handler_t handler = handlers[frame->vector];
+    if (handler == NULL) {
+        idt_fatal("Unhandled exception", frame);
+    }
+    handler(frame);
+}
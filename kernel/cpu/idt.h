@@ -0,0 +1,32 @@
+#ifndef __IDT_H__
+#define __IDT_H__
+
+#include <stdint.h>
+
+#define IDT_ENTRIES     256
+#define EXCEPTION_COUNT 32
+
+#define VECTOR_PAGE_FAULT 14
+
+// Register state pushed by the stubs in isr.asm, lowest address first
+typedef struct interrupt_frame {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code;    // 0 for vectors without one
+    // Pushed by the CPU
+    uint64_t rip, cs, rflags, rsp, ss;
+} interrupt_frame_t;
+
+typedef void (*interrupt_handler_t)(interrupt_frame_t* frame);
+
+// Installs the exception stubs and loads the IDT. Vectors without a
+// handler print the frame and halt
+void idt_init(void);
+
+void idt_set_handler(uint8_t vector, interrupt_handler_t handler);
+
+// Prints the frame and halts; for faults a handler cannot resolve
+__attribute__((noreturn)) void idt_fatal(const char* reason, interrupt_frame_t* frame);
+
+#endif // __IDT_H__
@@ -0,0 +1,108 @@
+; Exception entry stubs. Each one pushes a dummy error code where the CPU
+; does not, then its vector number, and joins isr_common, which saves the
+; general purpose registers and calls isr_dispatch(interrupt_frame_t*).
+; The push order has to match interrupt_frame_t in idt.h
+
+section .text
+
+extern isr_dispatch
+global isr_stub_table
+
+%macro ISR_NOERR 1
+isr_stub_%1:
+    push 0
+    push %1
+    jmp isr_common
+%endmacro
+
+%macro ISR_ERR 1
+isr_stub_%1:
+    push %1
+    jmp isr_common
+%endmacro
+
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29
+ISR_ERR   30
+ISR_NOERR 31
+
+; The CPU aligned RSP to 16 bytes before pushing its 5 qwords; with the
+; error code, the vector and 15 registers the frame is 22 qwords, so the
+; stack is still 16-byte aligned at the call
+isr_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    cld
+    mov rdi, rsp
+    call isr_dispatch
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    ; Drop the vector and error code
+    add rsp, 16
+    iretq
+
+section .data
+
+isr_stub_table:
+%assign i 0
+%rep 32
+    dq isr_stub_%+i
+%assign i i+1
+%endrep
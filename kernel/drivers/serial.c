@@ -18,3 +18,34 @@ void serial_write(const char* data, size_t size) {
 void serial_writestring(const char* data) {
     serial_write(data, strlen(data));
 }
+
+// Write an unsigned value in decimal
+void serial_writedec(uint64_t value) {
+    char buffer[21];
+    int i = sizeof(buffer) - 1;
+
+    buffer[i] = '\0';
+    do {
+        buffer[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    serial_writestring(&buffer[i]);
+}
+
+// Write an unsigned value as 0x-prefixed hex, without leading zeros
+void serial_writehex(uint64_t value) {
+    char buffer[19];
+    int i = sizeof(buffer) - 1;
+
+    buffer[i] = '\0';
+    do {
+        uint8_t nibble = value & 0xF;
+        buffer[--i] = nibble < 10 ? '0' + nibble : 'A' + (nibble - 10);
+        value >>= 4;
+    } while (value > 0);
+    buffer[--i] = 'x';
+    buffer[--i] = '0';
+
+    serial_writestring(&buffer[i]);
+}
@@ -11,5 +11,7 @@ void serial_putchar(char c);
 // C wrapper functions
 void serial_write(const char* data, size_t size);
 void serial_writestring(const char* data);
+void serial_writedec(uint64_t value);
+void serial_writehex(uint64_t value);
 
 #endif // __SERIAL_H__
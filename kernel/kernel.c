@@ -1,8 +1,22 @@
+#include "bootinfo.h"
+#include "cpu/idt.h"
 #include "drivers/serial.h"
 #include "output/terminal.h"
 #include "memory/pmm.h"
 #include "memory/vmm.h"
 #include "memory/kmalloc.h"
+#include "memory/heap.h"
+#include "memory/vma.h"
+#include "memory/vmalloc.h"
+#include "memory/kmem_cache.h"
+#include "memory/kprof.h"
+#include "memory/bench.h"
+
+#define TEST_OBJECT_MAGIC 0x0B1EC7ULL
+
+static void test_object_ctor(void* object) {
+    *(uint64_t*)object = TEST_OBJECT_MAGIC;
+}
 
 static void uint64_to_string(uint64_t value, char* buffer) {
     if (value == 0) {
@@ -25,11 +39,13 @@ static void uint64_to_string(uint64_t value, char* buffer) {
     buffer[j] = '\0';
 }
 
-void kMain(void) {
+void kMain(boot_info_t* boot_info) {
     serial_init();
 
     serial_writestring("\n\n=== IncroOS Kernel Starting ===\n");
 
+    idt_init();
+
     terminal_initialize();
 
     serial_writestring("===========================================\n");
@@ -40,9 +56,7 @@ void kMain(void) {
 
     serial_writestring("\n[INIT] Initializing Memory Subsystem...\n");
 
-    // 4GB
-    uint64_t total_memory = 4ULL * 1024 * 1024 * 1024;
-    pmm_init(total_memory);
+    pmm_init(boot_info);
 
     char buffer[32];
     uint64_to_string(pmm_get_total_pages(), buffer);
@@ -62,8 +76,19 @@ void kMain(void) {
 
     vmm_init();
 
+    // Nothing runs the idle loop until the tests below are done, so the
+    // zeroed allocations they make need the pool filled up front
+    pmm_zero_pool_fill();
+
     kmalloc_init();
 
+    // Profile the boot-time allocations below
+    kprof_start(0);
+
+    vma_init();
+
+    vmalloc_init();
+
     serial_writestring("\n[INIT] Memory Subsystem Initialized Successfully\n");
 
     serial_writestring("\n[TEST] Testing Memory Allocation...\n");
@@ -86,6 +111,51 @@ void kMain(void) {
         serial_writestring("[TEST] kmalloc(1024) failed\n");
     }
 
+    void* ptr3 = kmalloc(3 * PAGE_SIZE);
+    if (ptr3) {
+        serial_writestring("[TEST] kmalloc(12288) succeeded\n");
+        kfree(ptr3);
+        serial_writestring("[TEST] kfree(12288) succeeded\n");
+    } else {
+        serial_writestring("[TEST] kmalloc(12288) failed\n");
+    }
+
+    // Large requests bypass the heap for whole frames
+    void* ptr4 = kmalloc(0x100000);
+    if (ptr4 && !heap_contains(ptr4)) {
+        serial_writestring("[TEST] kmalloc(1MB) from page frames succeeded\n");
+    } else {
+        serial_writestring("[TEST] kmalloc(1MB) from page frames failed\n");
+    }
+    kfree(ptr4);
+
+    // Larger than the initial heap, so it has to grow
+    void* ptr5 = heap_alloc(0x100000);
+    if (ptr5) {
+        serial_writestring("[TEST] heap_alloc(1MB) grew the heap\n");
+        heap_free(ptr5);
+    } else {
+        serial_writestring("[TEST] heap_alloc(1MB) failed\n");
+    }
+
+    // Contents survive a move out of the slabs; alignment without padding
+    uint64_t* grown = (uint64_t*)kmalloc(64);
+    if (grown) {
+        grown[7] = 0x600D;
+        grown = (uint64_t*)krealloc(grown, 6000);
+    }
+    void* page_aligned = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    uint64_t* zeroed = (uint64_t*)kcalloc(8, sizeof(uint64_t));
+    if (grown && grown[7] == 0x600D && page_aligned && ((uint64_t)page_aligned & (PAGE_SIZE - 1)) == 0 &&
+        zeroed && zeroed[0] == 0 && zeroed[7] == 0) {
+        serial_writestring("[TEST] krealloc()/kmalloc_aligned()/kcalloc() succeeded\n");
+    } else {
+        serial_writestring("[TEST] krealloc()/kmalloc_aligned()/kcalloc() failed\n");
+    }
+    kfree(grown);
+    kfree(page_aligned);
+    kfree(zeroed);
+
     uint64_t page = pmm_alloc_page();
     if (page) {
         serial_writestring("[TEST] pmm_alloc_page() succeeded, page at: 0x");
@@ -102,6 +172,164 @@ void kMain(void) {
         serial_writestring("[TEST] pmm_alloc_page() failed\n");
     }
 
+    uint64_t block = pmm_alloc_pages(4);
+    if (block) {
+        serial_writestring("[TEST] pmm_alloc_pages(4) succeeded\n");
+        pmm_free_pages(block, 4);
+        serial_writestring("[TEST] pmm_free_pages(4) succeeded\n");
+    } else {
+        serial_writestring("[TEST] pmm_alloc_pages(4) failed\n");
+    }
+
+    uint64_t contiguous = pmm_alloc_contiguous(3, 0x200000);
+    if (contiguous && (contiguous & 0x1FFFFF) == 0) {
+        serial_writestring("[TEST] pmm_alloc_contiguous(3, 2MB) succeeded\n");
+        pmm_free_contiguous(contiguous, 3);
+        serial_writestring("[TEST] pmm_free_contiguous(3) succeeded\n");
+    } else {
+        serial_writestring("[TEST] pmm_alloc_contiguous(3, 2MB) failed\n");
+    }
+
+    if (vmm_get_physical(0x100000) == 0x100000 && vmm_get_page_size(0x100000) == PAGE_SIZE_2M) {
+        serial_writestring("[TEST] vmm_get_physical() on a 2MB boot page succeeded\n");
+    } else {
+        serial_writestring("[TEST] vmm_get_physical() on a 2MB boot page failed\n");
+    }
+
+    // 2MB + 4KB above the boot identity map: one huge page and one 4KB page
+    uint64_t window = 0x40000000;
+    vmm_stats_t before;
+    vmm_get_stats(&before);
+    if (vmm_map_range(window, 0x400000, PAGE_SIZE_2M + PAGE_SIZE_4K, PT_WRITABLE) &&
+        vmm_get_page_size(window) == PAGE_SIZE_2M &&
+        vmm_get_page_size(window + PAGE_SIZE_2M) == PAGE_SIZE_4K &&
+        vmm_get_physical(window + 0x1234) == 0x401234) {
+        serial_writestring("[TEST] vmm_map_range(2MB + 4KB) succeeded\n");
+        vmm_unmap_range(window, PAGE_SIZE_2M + PAGE_SIZE_4K);
+        serial_writestring("[TEST] vmm_unmap_range() succeeded\n");
+
+        vmm_stats_t after;
+        vmm_get_stats(&after);
+        if (after.page_table_pages == before.page_table_pages) {
+            serial_writestring("[TEST] Page tables reclaimed after unmap\n");
+        } else {
+            serial_writestring("[TEST] Page tables leaked after unmap\n");
+        }
+    } else {
+        serial_writestring("[TEST] vmm_map_range(2MB + 4KB) failed\n");
+    }
+
+    uint64_t frame = pmm_alloc_zeroed_page();
+    uint64_t* direct = (uint64_t*)phys_to_virt(frame);
+    if (frame && (uint64_t)direct >= DIRECT_MAP_BASE && virt_to_phys(direct) == frame &&
+        vmm_get_physical((uint64_t)direct) == frame) {
+        direct[0] = 0x1234;
+        serial_writestring(*(uint64_t*)frame == 0x1234 ? "[TEST] Direct map succeeded\n" : "[TEST] Direct map failed\n");
+        pmm_free_page(frame);
+    } else {
+        serial_writestring("[TEST] Direct map failed\n");
+    }
+
+    vmm_space_t* space = vmm_create_space();
+    uint64_t user_frame = pmm_alloc_page();
+    if (space && user_frame) {
+        vmm_switch(space);
+        bool mapped = vmm_map_page(USER_SPACE_BASE, user_frame, PT_WRITABLE) &&
+                      vmm_get_physical(USER_SPACE_BASE) == user_frame &&
+                      vmm_get_physical((uint64_t)phys_to_virt(user_frame)) == user_frame;
+        vmm_switch(vmm_get_kernel_space());
+        if (mapped && !vmm_is_mapped(USER_SPACE_BASE)) {
+            serial_writestring("[TEST] vmm_create_space()/vmm_switch() succeeded\n");
+        } else {
+            serial_writestring("[TEST] vmm_create_space()/vmm_switch() failed\n");
+        }
+        vmm_destroy_space(space);
+        pmm_free_page(user_frame);
+    } else {
+        serial_writestring("[TEST] vmm_create_space() failed\n");
+    }
+
+    // 16 pages registered, only the touched ones get frames
+    vm_area_t* area = vma_map_anon(vmm_get_kernel_space(), USER_SPACE_BASE, 16 * PAGE_SIZE, PT_WRITABLE);
+    if (area) {
+        vma_set_fault_around(area, 4);
+        volatile uint64_t* lazy = (volatile uint64_t*)(USER_SPACE_BASE + 5 * PAGE_SIZE);
+        lazy[0] = 0x5A5A;
+
+        vma_fault_stats_t faults;
+        vma_get_fault_stats(&faults);
+        if (lazy[0] == 0x5A5A && faults.minor_faults == 1 && faults.pages_mapped == 4 &&
+            vmm_is_mapped(USER_SPACE_BASE + 4 * PAGE_SIZE) && !vmm_is_mapped(USER_SPACE_BASE + 8 * PAGE_SIZE)) {
+            serial_writestring("[TEST] Demand-paged area with fault-around succeeded\n");
+        } else {
+            serial_writestring("[TEST] Demand-paged area with fault-around failed\n");
+        }
+        vma_remove(vmm_get_kernel_space(), area);
+    } else {
+        serial_writestring("[TEST] vma_map_anon() failed\n");
+    }
+
+    vmm_space_t* parent = vmm_create_space();
+    if (parent && vma_map_anon(parent, USER_SPACE_BASE, PAGE_SIZE, PT_WRITABLE)) {
+        volatile uint64_t* shared = (volatile uint64_t*)USER_SPACE_BASE;
+        vmm_switch(parent);
+        shared[0] = 1;
+        vmm_space_t* child = vmm_clone_space(parent);
+        bool cloned = child != NULL && vmm_get_physical(USER_SPACE_BASE) == vmm_space_get_physical(child, USER_SPACE_BASE);
+        if (cloned) {
+            vmm_switch(child);
+            cloned = shared[0] == 1;
+            shared[0] = 2;
+            vmm_switch(parent);
+            cloned = cloned && shared[0] == 1 &&
+                     vmm_get_physical(USER_SPACE_BASE) != vmm_space_get_physical(child, USER_SPACE_BASE);
+        }
+        vmm_switch(vmm_get_kernel_space());
+        serial_writestring(cloned ? "[TEST] Copy-on-write clone succeeded\n" : "[TEST] Copy-on-write clone failed\n");
+        vmm_destroy_space(child);
+    } else {
+        serial_writestring("[TEST] Copy-on-write clone failed\n");
+    }
+    vmm_destroy_space(parent);
+
+    // Three pages reserved, only the touched ones backed
+    uint64_t* buffer_va = (uint64_t*)vmalloc(3 * PAGE_SIZE);
+    if (buffer_va) {
+        buffer_va[0] = 1;
+        buffer_va[2 * PAGE_SIZE / sizeof(uint64_t)] = 2;
+        bool lazy = vmm_is_mapped((uint64_t)buffer_va) && !vmm_is_mapped((uint64_t)buffer_va + PAGE_SIZE);
+        vfree(buffer_va);
+        vmalloc_purge();
+        if (lazy && !vmm_is_mapped((uint64_t)buffer_va) && vmalloc(3 * PAGE_SIZE) == buffer_va) {
+            serial_writestring("[TEST] vmalloc()/vfree() succeeded\n");
+        } else {
+            serial_writestring("[TEST] vmalloc()/vfree() failed\n");
+        }
+        vfree(buffer_va);
+    } else {
+        serial_writestring("[TEST] vmalloc() failed\n");
+    }
+
+    // Constructed and cache-line aligned, and still constructed after a free
+    kmem_cache_t* test_cache = kmem_cache_create("test", 40, 0, test_object_ctor);
+    uint64_t* object = test_cache ? (uint64_t*)kmem_cache_alloc(test_cache) : NULL;
+    bool constructed = object && *object == TEST_OBJECT_MAGIC && ((uint64_t)object & (CACHE_LINE_SIZE - 1)) == 0;
+    if (object) {
+        kmem_cache_free(test_cache, object);
+        uint64_t* again = (uint64_t*)kmem_cache_alloc(test_cache);
+        constructed = constructed && again == object && *again == TEST_OBJECT_MAGIC;
+        kmem_cache_free(test_cache, again);
+    }
+    if (constructed && kmem_cache_destroy(test_cache)) {
+        serial_writestring("[TEST] kmem_cache constructed objects succeeded\n");
+    } else {
+        serial_writestring("[TEST] kmem_cache constructed objects failed\n");
+    }
+
+#ifdef MM_BENCH
+    mm_bench_run();
+#endif
+
     uint64_to_string(kmalloc_get_used(), buffer);
     serial_writestring("\n[HEAP] Used memory: ");
     serial_writestring(buffer);
@@ -112,13 +340,37 @@ void kMain(void) {
     serial_writestring(buffer);
     serial_writestring(" bytes\n");
 
+    vmm_stats_t vmm_stats;
+    vmm_get_stats(&vmm_stats);
+    uint64_to_string(vmm_stats.page_table_pages * PAGE_SIZE, buffer);
+    serial_writestring("[VMM] Page table memory: ");
+    serial_writestring(buffer);
+    serial_writestring(" bytes\n");
+
+    pmm_stats_t pmm_stats;
+    pmm_get_stats(&pmm_stats);
+    uint64_to_string(pmm_stats.zero_pool_hits, buffer);
+    serial_writestring("[PMM] Zero pool: ");
+    serial_writestring(buffer);
+    uint64_to_string(pmm_stats.zero_pool_misses, buffer);
+    serial_writestring(" hits, ");
+    serial_writestring(buffer);
+    serial_writestring(" misses\n");
+
+    kmalloc_stats_dump();
+    kprof_dump();
+    kmem_cache_dump();
+
     serial_writestring("\n===========================================\n");
     serial_writestring("  Memory Manager Tests Complete\n");
     serial_writestring("===========================================\n");
 
     terminal_writestring("Memory Manager Initialized!\n");
 
+    // Interrupts stay off and there is no timer yet, so this refills the
+    // pool once and halts; it becomes a real idle loop with a scheduler
     while (1) {
+        pmm_zero_pool_refill();
         __asm__ volatile("hlt");
     }
 }
@@ -0,0 +1,283 @@
+#include "bench.h"
+#include "pmm.h"
+#include "page.h"
+#include "vmm.h"
+#include "vma.h"
+#include "heap.h"
+#include "../cpu/cpu.h"
+#include "../drivers/serial.h"
+
+#define SWITCH_ROUNDS      10000
+#define SWITCH_TOUCH_PAGES 16
+
+#define CLONE_ROUNDS 16
+#define CLONE_PAGES  256
+
+#define HEAP_BENCH_BLOCKS 1024
+#define HEAP_BENCH_ROUNDS 16384
+
+static void* heap_blocks[HEAP_BENCH_BLOCKS];
+
+static void print_result(const char* name, uint64_t cycles, uint64_t ops) {
+    serial_writestring("[BENCH] ");
+    serial_writestring(name);
+    serial_writestring(": ");
+    serial_writedec(ops ? cycles / ops : 0);
+    serial_writestring(" cycles/op (");
+    serial_writedec(ops);
+    serial_writestring(" ops)\n");
+}
+
+// Reads one word from each page so the switch cost includes refilling
+// the TLB for a small working set
+static void touch_pages(uint64_t base) {
+    for (uint64_t i = 0; i < SWITCH_TOUCH_PAGES; i++) {
+        (void)*(volatile uint64_t*)(base + i * PAGE_SIZE);
+    }
+}
+
+static uint64_t time_switches(vmm_space_t* a, vmm_space_t* b, uint64_t base) {
+    uint64_t start = cpu_rdtsc();
+    for (uint64_t i = 0; i < SWITCH_ROUNDS; i++) {
+        vmm_switch(a);
+        touch_pages(base);
+        vmm_switch(b);
+        touch_pages(base);
+    }
+    return cpu_rdtsc() - start;
+}
+
+// Two spaces with the same user addresses backed by different frames,
+// switched back and forth with and without PCID tagging
+static void bench_space_switch(void) {
+    vmm_space_t* spaces[2] = { vmm_create_space(), vmm_create_space() };
+    uint64_t frames[2][SWITCH_TOUCH_PAGES];
+    uint64_t base = USER_SPACE_BASE;
+    bool ready = spaces[0] != NULL && spaces[1] != NULL;
+
+    for (int s = 0; s < 2; s++) {
+        if (spaces[s] == NULL) {
+            continue;
+        }
+        vmm_switch(spaces[s]);
+        for (uint64_t i = 0; i < SWITCH_TOUCH_PAGES; i++) {
+            frames[s][i] = pmm_alloc_zeroed_page();
+            if (frames[s][i] == 0 || !vmm_map_page(base + i * PAGE_SIZE, frames[s][i], PT_WRITABLE)) {
+                ready = false;
+            }
+        }
+    }
+
+    if (ready) {
+        vmm_set_pcid(false);
+        print_result("space switch, no PCID", time_switches(spaces[0], spaces[1], base), 2 * SWITCH_ROUNDS);
+
+        if (vmm_set_pcid(true)) {
+            print_result("space switch, PCID", time_switches(spaces[0], spaces[1], base), 2 * SWITCH_ROUNDS);
+        } else {
+            serial_writestring("[BENCH] space switch, PCID: not supported\n");
+        }
+    } else {
+        serial_writestring("[BENCH] space switch: out of memory\n");
+    }
+
+    for (int s = 0; s < 2; s++) {
+        if (spaces[s] == NULL) {
+            continue;
+        }
+        vmm_switch(spaces[s]);
+        for (uint64_t i = 0; i < SWITCH_TOUCH_PAGES; i++) {
+            if (frames[s][i] != 0) {
+                vmm_unmap_page(base + i * PAGE_SIZE);
+                pmm_free_page(frames[s][i]);
+            }
+        }
+        vmm_destroy_space(spaces[s]);
+    }
+}
+
+// What vmm_clone_space() would cost without copy-on-write: a fresh frame
+// and a full page copy for every present page
+static vmm_space_t* eager_copy(vmm_space_t* src, uint64_t base) {
+    vmm_space_t* space = vmm_create_space();
+    if (space == NULL) {
+        return NULL;
+    }
+    if (vma_map_anon(space, base, CLONE_PAGES * PAGE_SIZE, PT_WRITABLE) == NULL) {
+        vmm_destroy_space(space);
+        return NULL;
+    }
+
+    vmm_switch(space);
+    for (uint64_t i = 0; i < CLONE_PAGES; i++) {
+        uint64_t addr = base + i * PAGE_SIZE;
+        uint64_t phys = vmm_space_get_physical(src, addr);
+        if (phys == 0) {
+            continue;
+        }
+
+        uint64_t copy = pmm_alloc_page();
+        if (copy == 0) {
+            break;
+        }
+        pmm_copy_page(copy, phys);
+        phys_to_page(copy)->type = PAGE_TYPE_ANON;
+        if (!vmm_map_page(addr, copy, PT_WRITABLE)) {
+            pmm_free_page(copy);
+            break;
+        }
+    }
+    vmm_switch(src);
+    return space;
+}
+
+static void write_pages(uint64_t base, uint64_t value) {
+    for (uint64_t i = 0; i < CLONE_PAGES; i++) {
+        *(volatile uint64_t*)(base + i * PAGE_SIZE) = value;
+    }
+}
+
+// Clones a space with CLONE_PAGES touched anonymous pages, copy-on-write
+// versus eagerly, and what the COW clone pays later when every page is
+// written
+static void bench_clone(void) {
+    uint64_t base = USER_SPACE_BASE;
+    vmm_space_t* src = vmm_create_space();
+    if (src == NULL || vma_map_anon(src, base, CLONE_PAGES * PAGE_SIZE, PT_WRITABLE) == NULL) {
+        serial_writestring("[BENCH] space clone: out of memory\n");
+        vmm_destroy_space(src);
+        return;
+    }
+    vmm_switch(src);
+    write_pages(base, 1);
+
+    uint64_t cow_cycles = 0;
+    uint64_t break_cycles = 0;
+    uint64_t eager_cycles = 0;
+    uint64_t rounds = 0;
+
+    for (; rounds < CLONE_ROUNDS; rounds++) {
+        uint64_t start = cpu_rdtsc();
+        vmm_space_t* clone = vmm_clone_space(src);
+        cow_cycles += cpu_rdtsc() - start;
+
+        start = cpu_rdtsc();
+        vmm_space_t* copy = eager_copy(src, base);
+        eager_cycles += cpu_rdtsc() - start;
+
+        if (clone == NULL || copy == NULL) {
+            vmm_destroy_space(clone);
+            vmm_destroy_space(copy);
+            break;
+        }
+
+        vmm_switch(clone);
+        start = cpu_rdtsc();
+        write_pages(base, 2);
+        break_cycles += cpu_rdtsc() - start;
+        vmm_switch(src);
+
+        vmm_destroy_space(clone);
+        vmm_destroy_space(copy);
+    }
+
+    if (rounds == CLONE_ROUNDS) {
+        print_result("space clone, copy-on-write (256 pages)", cow_cycles, rounds);
+        print_result("space clone, eager copy (256 pages)", eager_cycles, rounds);
+        print_result("copy-on-write break", break_cycles, rounds * CLONE_PAGES);
+    } else {
+        serial_writestring("[BENCH] space clone: out of memory\n");
+    }
+
+    vmm_switch(vmm_get_kernel_space());
+    vmm_destroy_space(src);
+}
+
+// xorshift64, seeded the same on every boot so runs compare
+static uint64_t bench_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void print_heap_result(const char* op, uint64_t total, uint64_t worst, uint64_t ops) {
+    serial_writestring("[BENCH] heap ");
+    serial_writestring(op);
+    serial_writestring(", ");
+    serial_writestring(heap_get_backend());
+    serial_writestring(": ");
+    serial_writedec(ops ? total / ops : 0);
+    serial_writestring(" cycles/op, worst ");
+    serial_writedec(worst);
+    serial_writestring(" cycles (");
+    serial_writedec(ops);
+    serial_writestring(" ops)\n");
+}
+
+// Random allocations and frees over a fixed set of slots, mostly small
+// with some up to 16 KB, which leaves the heap with a few hundred free
+// blocks. First fit may walk all of them for a large request; TLSF
+// indexes straight into a large enough list. Only the second half is
+// timed, once the heap has grown to its working size. Build with and
+// without HEAP_TLSF to compare the two
+static void bench_heap(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    uint64_t alloc_total = 0, alloc_worst = 0, allocs = 0;
+    uint64_t free_total = 0, free_worst = 0, frees = 0;
+    bool failed = false;
+
+    for (uint32_t i = 0; i < HEAP_BENCH_BLOCKS; i++) {
+        heap_blocks[i] = NULL;
+    }
+
+    for (uint32_t round = 0; round < 2 * HEAP_BENCH_ROUNDS && !failed; round++) {
+        uint32_t slot = (uint32_t)(bench_random(&seed) % HEAP_BENCH_BLOCKS);
+        bool timed = round >= HEAP_BENCH_ROUNDS;
+
+        if (heap_blocks[slot] != NULL) {
+            uint64_t start = cpu_rdtsc();
+            heap_free(heap_blocks[slot]);
+            uint64_t cycles = cpu_rdtsc() - start;
+            heap_blocks[slot] = NULL;
+            if (timed) {
+                free_total += cycles;
+                free_worst = cycles > free_worst ? cycles : free_worst;
+                frees++;
+            }
+        } else {
+            uint64_t limit = bench_random(&seed) % 4 != 0 ? 1024 : 16384;
+            size_t size = 32 + bench_random(&seed) % limit;
+            uint64_t start = cpu_rdtsc();
+            heap_blocks[slot] = heap_alloc(size);
+            uint64_t cycles = cpu_rdtsc() - start;
+            failed = heap_blocks[slot] == NULL;
+            if (timed) {
+                alloc_total += cycles;
+                alloc_worst = cycles > alloc_worst ? cycles : alloc_worst;
+                allocs++;
+            }
+        }
+    }
+
+    if (!failed) {
+        print_heap_result("alloc", alloc_total, alloc_worst, allocs);
+        print_heap_result("free", free_total, free_worst, frees);
+    } else {
+        serial_writestring("[BENCH] heap: out of memory\n");
+    }
+
+    for (uint32_t i = 0; i < HEAP_BENCH_BLOCKS; i++) {
+        heap_free(heap_blocks[i]);
+    }
+}
+
+void mm_bench_run(void) {
+    serial_writestring("\n[BENCH] Memory manager benchmarks\n");
+
+    bench_space_switch();
+    bench_clone();
+    bench_heap();
+}
@@ -0,0 +1,8 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+// Memory manager micro-benchmarks. kMain only runs them when the kernel
+// is configured with -DMM_BENCH=ON; results go to the serial port
+void mm_bench_run(void);
+
+#endif // __BENCH_H__
@@ -0,0 +1,666 @@
+#include "heap.h"
+#include "pmm.h"
+#include "page.h"
+#include "vmm.h"
+#include "../drivers/serial.h"
+
+// Boundary-tag blocks: a header and a matching footer carry the block
+// size with the in-use flag in bit 0, so both neighbours of a block can be
+// found in O(1). Free blocks keep their free-list links in the payload.
+//
+// The free blocks are indexed either by one first-fit list or, with
+// HEAP_TLSF, by TLSF's two-level segregated lists, where a pair of bitmaps
+// finds a fitting list in O(1)
+typedef struct block_header {
+    uint64_t tag;
+    uint64_t requested;     // bytes asked for, while in use
+} block_header_t;
+
+typedef struct free_block {
+    block_header_t header;
+    struct free_block* prev;
+    struct free_block* next;
+} free_block_t;
+
+// Grows by at least this much at a time
+#define HEAP_GROW_MIN 0x10000
+
+#define TAG_USED          1ULL
+#define BLOCK_ALIGN       16
+#define BLOCK_HEADER_SIZE sizeof(block_header_t)
+#define BLOCK_FOOTER_SIZE sizeof(uint64_t)
+#define BLOCK_OVERHEAD    (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE)
+// Room for the header, the free-list links and the footer
+#define BLOCK_MIN_SIZE    48
+
+#ifdef HEAP_TLSF
+// The first level splits sizes by power of two, the second splits each
+// power of two into TLSF_SL_COUNT lists. Sizes below TLSF_SMALL_SIZE all
+// go to first-level list 0, in BLOCK_ALIGN steps
+#define TLSF_SL_LOG2    4
+#define TLSF_SL_COUNT   (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT   (TLSF_SL_LOG2 + 4)
+#define TLSF_SMALL_SIZE (1ULL << TLSF_FL_SHIFT)
+// Enough for a block spanning all of HEAP_RESERVE
+#define TLSF_FL_COUNT   (40 - TLSF_FL_SHIFT + 2)
+
+static uint64_t fl_bitmap = 0;
+static uint32_t sl_bitmap[TLSF_FL_COUNT];
+static free_block_t* tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+#else
+static free_block_t* free_list = NULL;
+#endif
+
+static uint64_t total_allocated = 0;
+static uint64_t total_free = 0;
+
+// Kept up to date as blocks are linked and unlinked. The largest free
+// block is only looked for again once the last block of its size is gone
+static uint64_t free_block_count = 0;
+static uint64_t largest_free = 0;       // block size
+static uint64_t largest_count = 0;      // free blocks of exactly that size
+static bool largest_stale = false;
+static uint64_t free_histogram[HEAP_HIST_BUCKETS];
+
+// Mapped part of the reserved region, [HEAP_BASE, heap_end)
+static uint64_t heap_end = 0;
+// Set while heap_grow() maps frames, which can run the PMM reclaim hook
+static bool growing = false;
+static uint64_t watermark_low = HEAP_TRIM_LOW;
+static uint64_t watermark_high = HEAP_TRIM_HIGH;
+
+static inline uint64_t block_size(const block_header_t* block) {
+    return block->tag & ~TAG_USED;
+}
+
+static inline bool block_used(const block_header_t* block) {
+    return (block->tag & TAG_USED) != 0;
+}
+
+static inline uint64_t* block_footer(block_header_t* block) {
+    return (uint64_t*)((uint8_t*)block + block_size(block) - BLOCK_FOOTER_SIZE);
+}
+
+static inline void block_set(block_header_t* block, uint64_t size, bool used) {
+    block->tag = size | (used ? TAG_USED : 0);
+    *block_footer(block) = block->tag;
+}
+
+static inline block_header_t* block_next(block_header_t* block) {
+    return (block_header_t*)((uint8_t*)block + block_size(block));
+}
+
+// The previous block's footer sits right below the header
+static inline block_header_t* block_prev(block_header_t* block) {
+    uint64_t prev_tag = *((uint64_t*)block - 1);
+    return (block_header_t*)((uint8_t*)block - (prev_tag & ~TAG_USED));
+}
+
+static inline bool prev_used(block_header_t* block) {
+    return (*((uint64_t*)block - 1) & TAG_USED) != 0;
+}
+
+static inline uint32_t histogram_bucket(uint64_t bytes) {
+    uint32_t bucket = 63 - __builtin_clzll(bytes);
+    return bucket < HEAP_HIST_BUCKETS ? bucket : HEAP_HIST_BUCKETS - 1;
+}
+
+static void account_link(block_header_t* block) {
+    uint64_t size = block_size(block);
+    total_free += size - BLOCK_OVERHEAD;
+    free_histogram[histogram_bucket(size - BLOCK_OVERHEAD)]++;
+    free_block_count++;
+
+    if (largest_stale) {
+        return;
+    }
+    if (size > largest_free) {
+        largest_free = size;
+        largest_count = 1;
+    } else if (size == largest_free) {
+        largest_count++;
+    }
+}
+
+static void account_unlink(block_header_t* block) {
+    uint64_t size = block_size(block);
+    total_free -= size - BLOCK_OVERHEAD;
+    free_histogram[histogram_bucket(size - BLOCK_OVERHEAD)]--;
+    free_block_count--;
+
+    if (free_block_count == 0) {
+        largest_free = 0;
+        largest_count = 0;
+        largest_stale = false;
+    } else if (!largest_stale && size == largest_free && --largest_count == 0) {
+        largest_stale = true;
+    }
+}
+
+#ifdef HEAP_TLSF
+// List a free block of this size belongs on
+static inline void tlsf_mapping(uint64_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = (uint32_t)(size / BLOCK_ALIGN);
+        return;
+    }
+    uint32_t top = 63 - __builtin_clzll(size);
+    *fl = top - TLSF_FL_SHIFT + 1;
+    *sl = (uint32_t)(size >> (top - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+// Rounds a request up to the next list boundary, so every block on the
+// list it maps to is large enough
+static inline uint64_t fit_size(uint64_t size) {
+    if (size >= TLSF_SMALL_SIZE) {
+        size += (1ULL << (63 - __builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+static void free_index_reset(void) {
+    fl_bitmap = 0;
+    for (uint32_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        sl_bitmap[fl] = 0;
+        for (uint32_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            tlsf_lists[fl][sl] = NULL;
+        }
+    }
+}
+
+static void free_block_link(block_header_t* block) {
+    uint32_t fl, sl;
+    tlsf_mapping(block_size(block), &fl, &sl);
+
+    free_block_t* node = (free_block_t*)block;
+    node->prev = NULL;
+    node->next = tlsf_lists[fl][sl];
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+    tlsf_lists[fl][sl] = node;
+    fl_bitmap |= 1ULL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    account_link(block);
+}
+
+static void free_block_unlink(block_header_t* block) {
+    uint32_t fl, sl;
+    tlsf_mapping(block_size(block), &fl, &sl);
+
+    free_block_t* node = (free_block_t*)block;
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        tlsf_lists[fl][sl] = node->next;
+        if (node->next == NULL) {
+            sl_bitmap[fl] &= ~(1U << sl);
+            if (sl_bitmap[fl] == 0) {
+                fl_bitmap &= ~(1ULL << fl);
+            }
+        }
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    account_unlink(block);
+}
+
+// Head of the first non-empty list at or above the one need rounds up to
+static block_header_t* find_fit(uint64_t need) {
+    uint32_t fl, sl;
+    tlsf_mapping(fit_size(need), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = fl + 1 < 64 ? fl_bitmap & (~0ULL << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return &tlsf_lists[fl][__builtin_ctz(sl_map)]->header;
+}
+
+// The largest block is on the highest non-empty list
+static void find_largest(void) {
+    uint32_t fl = 63 - __builtin_clzll(fl_bitmap);
+    uint32_t sl = 31 - __builtin_clz(sl_bitmap[fl]);
+
+    largest_free = 0;
+    largest_count = 0;
+    for (free_block_t* node = tlsf_lists[fl][sl]; node != NULL; node = node->next) {
+        uint64_t size = block_size(&node->header);
+        if (size > largest_free) {
+            largest_free = size;
+            largest_count = 1;
+        } else if (size == largest_free) {
+            largest_count++;
+        }
+    }
+}
+#else
+static inline uint64_t fit_size(uint64_t size) {
+    return size;
+}
+
+static void free_index_reset(void) {
+    free_list = NULL;
+}
+
+static void free_block_link(block_header_t* block) {
+    free_block_t* node = (free_block_t*)block;
+    node->prev = NULL;
+    node->next = free_list;
+    if (free_list != NULL) {
+        free_list->prev = node;
+    }
+    free_list = node;
+    account_link(block);
+}
+
+static void free_block_unlink(block_header_t* block) {
+    free_block_t* node = (free_block_t*)block;
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        free_list = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    account_unlink(block);
+}
+
+// First fit over the free blocks only
+static block_header_t* find_fit(uint64_t need) {
+    free_block_t* node = free_list;
+    while (node != NULL && block_size(&node->header) < need) {
+        node = node->next;
+    }
+    return node != NULL ? &node->header : NULL;
+}
+
+static void find_largest(void) {
+    largest_free = 0;
+    largest_count = 0;
+    for (free_block_t* node = free_list; node != NULL; node = node->next) {
+        uint64_t size = block_size(&node->header);
+        if (size > largest_free) {
+            largest_free = size;
+            largest_count = 1;
+        } else if (size == largest_free) {
+            largest_count++;
+        }
+    }
+}
+#endif
+
+static void release_frame(uint64_t phys, uint64_t size) {
+    (void)size;
+    pmm_free_page(phys);
+}
+
+// Backs [start, start + bytes) with fresh frames. On failure nothing new
+// stays mapped
+static bool map_frames(uint64_t start, uint64_t bytes) {
+    for (uint64_t offset = 0; offset < bytes; offset += PAGE_SIZE) {
+        uint64_t phys = pmm_alloc_page();
+        if (phys == 0 || !vmm_map_page(start + offset, phys, PT_WRITABLE)) {
+            if (phys != 0) {
+                pmm_free_page(phys);
+            }
+            vmm_space_unmap_range(vmm_get_kernel_space(), start, offset, release_frame);
+            return false;
+        }
+        phys_to_page(phys)->type = PAGE_TYPE_HEAP;
+    }
+    return true;
+}
+
+static inline void set_epilogue(void) {
+    block_header_t* epilogue = (block_header_t*)(heap_end - BLOCK_HEADER_SIZE);
+    epilogue->tag = TAG_USED;
+    epilogue->requested = 0;
+}
+
+static inline bool is_last_block(block_header_t* block) {
+    return (uint64_t)block_next(block) == heap_end - BLOCK_HEADER_SIZE;
+}
+
+// Marks a block free, merges it with free neighbours and links the result
+static block_header_t* release_block(block_header_t* block) {
+    uint64_t size = block_size(block);
+
+    block_header_t* next = block_next(block);
+    if (!block_used(next)) {
+        free_block_unlink(next);
+        size += block_size(next);
+    }
+
+    if (!prev_used(block)) {
+        block_header_t* prev = block_prev(block);
+        free_block_unlink(prev);
+        size += block_size(prev);
+        block = prev;
+    }
+
+    block_set(block, size, false);
+    free_block_link(block);
+    return block;
+}
+
+// Maps at least bytes more at the end; the old epilogue becomes the header
+// of the new space, which merges with a free last block
+static bool heap_grow(uint64_t bytes) {
+    bytes = (bytes + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (bytes < HEAP_GROW_MIN) {
+        bytes = HEAP_GROW_MIN;
+    }
+    if (bytes > HEAP_BASE + HEAP_RESERVE - heap_end) {
+        return false;
+    }
+    growing = true;
+    bool mapped = map_frames(heap_end, bytes);
+    growing = false;
+    if (!mapped) {
+        return false;
+    }
+
+    block_header_t* block = (block_header_t*)(heap_end - BLOCK_HEADER_SIZE);
+    heap_end += bytes;
+    set_epilogue();
+
+    block_set(block, bytes, true);
+    release_block(block);
+    return true;
+}
+
+// Unmaps whole free pages at the end of the heap until at most keep free
+// bytes are left there, never going below HEAP_INITIAL_SIZE
+static void heap_shrink(uint64_t keep) {
+    block_header_t* last = (block_header_t*)(heap_end - BLOCK_HEADER_SIZE);
+    if (prev_used(last)) {
+        return;
+    }
+    block_header_t* block = block_prev(last);
+
+    uint64_t new_end = (uint64_t)block + BLOCK_MIN_SIZE + keep + BLOCK_HEADER_SIZE;
+    new_end = (new_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (new_end < HEAP_BASE + HEAP_INITIAL_SIZE) {
+        new_end = HEAP_BASE + HEAP_INITIAL_SIZE;
+    }
+    if (new_end >= heap_end) {
+        return;
+    }
+
+    uint64_t old_end = heap_end;
+    free_block_unlink(block);
+    heap_end = new_end;
+    set_epilogue();
+    block_set(block, heap_end - BLOCK_HEADER_SIZE - (uint64_t)block, false);
+    free_block_link(block);
+
+    vmm_space_unmap_range(vmm_get_kernel_space(), new_end, old_end - new_end, release_frame);
+}
+
+void heap_init(void) {
+    free_index_reset();
+    total_allocated = 0;
+    growing = false;
+    total_free = 0;
+    free_block_count = 0;
+    largest_free = 0;
+    largest_count = 0;
+    largest_stale = false;
+    for (uint32_t i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        free_histogram[i] = 0;
+    }
+    watermark_low = HEAP_TRIM_LOW;
+    watermark_high = HEAP_TRIM_HIGH;
+
+    heap_end = HEAP_BASE;
+    if (!map_frames(HEAP_BASE, HEAP_INITIAL_SIZE)) {
+        serial_writestring("[HEAP] Out of memory mapping the initial heap\n");
+        return;
+    }
+    heap_end = HEAP_BASE + HEAP_INITIAL_SIZE;
+
+    // A used footer below the first block and a used, zero-sized header
+    // after the last one keep coalescing inside the heap
+    uint64_t* prologue = (uint64_t*)(HEAP_BASE + BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE);
+    *prologue = BLOCK_HEADER_SIZE | TAG_USED;
+    set_epilogue();
+
+    block_header_t* first = (block_header_t*)(HEAP_BASE + BLOCK_HEADER_SIZE);
+    block_set(first, HEAP_INITIAL_SIZE - 2 * BLOCK_HEADER_SIZE, false);
+    free_block_link(first);
+
+    serial_writestring("[HEAP] Kernel heap initialized at ");
+    serial_writehex(HEAP_BASE);
+    serial_writestring("\n");
+}
+
+// Block size for a payload of size bytes
+static inline uint64_t block_need(size_t size) {
+    uint64_t need = (size + BLOCK_OVERHEAD + BLOCK_ALIGN - 1) & ~(uint64_t)(BLOCK_ALIGN - 1);
+    return need < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : need;
+}
+
+static inline block_header_t* block_of(void* ptr) {
+    return (block_header_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
+}
+
+// Unlinks a free block of at least bytes, growing the heap if there is none
+static block_header_t* take_free_block(uint64_t bytes) {
+    if (bytes > HEAP_RESERVE) {
+        return NULL;
+    }
+
+    block_header_t* block = find_fit(bytes);
+    if (block == NULL) {
+        // Grown by the rounded size, the new last block is sure to be found
+        if (heap_end == HEAP_BASE || !heap_grow(fit_size(bytes))) {
+            return NULL;
+        }
+        block = find_fit(bytes);
+    }
+    free_block_unlink(block);
+    return block;
+}
+
+// Marks an unlinked block used for need bytes; a remainder large enough to
+// stand on its own goes back to the free blocks
+static void* use_block(block_header_t* block, uint64_t need, size_t size) {
+    uint64_t size_found = block_size(block);
+
+    if (size_found - need >= BLOCK_MIN_SIZE) {
+        block_set(block, need, true);
+        block_header_t* rest = block_next(block);
+        block_set(rest, size_found - need, false);
+        free_block_link(rest);
+    } else {
+        block_set(block, size_found, true);
+    }
+
+    block->requested = size;
+    total_allocated += block_size(block) - BLOCK_OVERHEAD;
+    return (uint8_t*)block + BLOCK_HEADER_SIZE;
+}
+
+// Frees a used block, trimming the heap if that leaves too much free at
+// its end
+static void release_and_trim(block_header_t* block) {
+    block = release_block(block);
+    if (is_last_block(block) && block_size(block) > watermark_high) {
+        heap_shrink(watermark_low);
+    }
+}
+
+void* heap_alloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    uint64_t need = block_need(size);
+    block_header_t* block = take_free_block(need);
+    if (block == NULL) {
+        return NULL;
+    }
+    return use_block(block, need, size);
+}
+
+void* heap_alloc_aligned(size_t size, size_t align) {
+    if (align <= BLOCK_ALIGN) {
+        return heap_alloc(size);
+    }
+    if (size == 0 || (align & (align - 1)) != 0 || align > HEAP_RESERVE) {
+        return NULL;
+    }
+
+    // Room for the aligned payload after a leading gap big enough to be a
+    // free block of its own
+    uint64_t need = block_need(size);
+    block_header_t* block = take_free_block(need + align + BLOCK_MIN_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    uint64_t payload = (uint64_t)block + BLOCK_HEADER_SIZE;
+    uint64_t aligned = (payload + align - 1) & ~(uint64_t)(align - 1);
+    if (aligned != payload) {
+        while (aligned - payload < BLOCK_MIN_SIZE) {
+            aligned += align;
+        }
+        uint64_t gap = aligned - payload;
+        uint64_t total = block_size(block);
+
+        block_set(block, gap, false);
+        free_block_link(block);
+        block = (block_header_t*)((uint8_t*)block + gap);
+        block_set(block, total - gap, false);
+    }
+    return use_block(block, need, size);
+}
+
+bool heap_resize(void* ptr, size_t size) {
+    block_header_t* block = block_of(ptr);
+    if (size == 0 || !block_used(block)) {
+        return false;
+    }
+
+    uint64_t need = block_need(size);
+    uint64_t current = block_size(block);
+
+    if (need <= current) {
+        // Shrinks by splitting off the tail as a free block
+        if (current - need >= BLOCK_MIN_SIZE) {
+            total_allocated -= current - need;
+            block_set(block, need, true);
+            block_header_t* rest = block_next(block);
+            block_set(rest, current - need, true);
+            release_and_trim(rest);
+        }
+        block->requested = size;
+        return true;
+    }
+
+    // Grows into a free next block; the last block grows with the heap
+    block_header_t* next = block_next(block);
+    if (next == (block_header_t*)(heap_end - BLOCK_HEADER_SIZE)) {
+        if (!heap_grow(need - current)) {
+            return false;
+        }
+        next = block_next(block);
+    }
+    if (block_used(next) || current + block_size(next) < need) {
+        return false;
+    }
+
+    free_block_unlink(next);
+    total_allocated -= current - BLOCK_OVERHEAD;
+    block_set(block, current + block_size(next), true);
+    use_block(block, need, size);
+    return true;
+}
+
+void heap_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    block_header_t* block = block_of(ptr);
+
+    if (!block_used(block)) {
+        return;
+    }
+
+    total_allocated -= block_size(block) - BLOCK_OVERHEAD;
+    release_and_trim(block);
+}
+
+size_t heap_usable_size(void* ptr) {
+    return block_size(block_of(ptr)) - BLOCK_OVERHEAD;
+}
+
+void heap_trim(void) {
+    // A trim from inside heap_grow() would unmap next to the range being
+    // mapped, and the grow needs the space anyway
+    if (heap_end != HEAP_BASE && !growing) {
+        heap_shrink(watermark_low);
+    }
+}
+
+bool heap_set_watermarks(uint64_t low, uint64_t high) {
+    if (low > high) {
+        return false;
+    }
+    watermark_low = low;
+    watermark_high = high;
+    return true;
+}
+
+bool heap_contains(const void* ptr) {
+    return (uint64_t)ptr >= HEAP_BASE && (uint64_t)ptr < heap_end;
+}
+
+const char* heap_get_backend(void) {
+#ifdef HEAP_TLSF
+    return "tlsf";
+#else
+    return "first-fit";
+#endif
+}
+
+uint64_t heap_get_size(void) {
+    return heap_end - HEAP_BASE;
+}
+
+void heap_get_stats(heap_stats_t* stats) {
+    if (largest_stale) {
+        find_largest();
+        largest_stale = false;
+    }
+
+    stats->size = heap_end - HEAP_BASE;
+    stats->used_bytes = total_allocated;
+    stats->free_bytes = total_free;
+    stats->free_blocks = free_block_count;
+    stats->largest_free = largest_free != 0 ? largest_free - BLOCK_OVERHEAD : 0;
+    for (uint32_t i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        stats->free_histogram[i] = free_histogram[i];
+    }
+}
+
+uint64_t heap_get_used(void) {
+    return total_allocated;
+}
+
+uint64_t heap_get_free(void) {
+    return total_free;
+}
@@ -0,0 +1,76 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Variable-size region allocator behind kmalloc() for requests too large
+// for the slab caches. It lives in a reserved kernel virtual region and is
+// backed by PMM frames as it grows
+
+#define HEAP_BASE         0xFFFFE00000000000ULL
+#define HEAP_RESERVE      0x0000010000000000ULL   // 1 TB of address space
+#define HEAP_INITIAL_SIZE 0x80000
+
+// Default watermarks for the free space at the end of the heap: once a
+// free pushes it above the high one, pages are unmapped until the low
+// one is left
+#define HEAP_TRIM_HIGH 0x100000
+#define HEAP_TRIM_LOW  0x40000
+
+// heap_stats_t.free_histogram buckets; the last one also takes everything
+// larger
+#define HEAP_HIST_BUCKETS 32
+
+// Byte counts are payload bytes, block tags excluded
+typedef struct heap_stats {
+    uint64_t size;          // mapped
+    uint64_t used_bytes;
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;
+    // Free blocks by floor(log2(payload bytes))
+    uint64_t free_histogram[HEAP_HIST_BUCKETS];
+} heap_stats_t;
+
+// Needs vmm_init()
+void heap_init(void);
+void* heap_alloc(size_t size);
+void heap_free(void* ptr);
+
+// align is a power of two; the gap in front of the block is left free
+void* heap_alloc_aligned(size_t size, size_t align);
+
+// Resizes a block in place, by splitting it or by taking in a free block
+// that follows. Returns false, leaving the block alone, if it cannot
+bool heap_resize(void* ptr, size_t size);
+
+// Payload bytes of a heap block, at least what was asked for
+size_t heap_usable_size(void* ptr);
+
+// Gives free trailing pages back down to the low watermark. The PMM runs
+// it through the kmalloc reclaim hook when it is out of frames
+void heap_trim(void);
+
+// Returns false if low is above high
+bool heap_set_watermarks(uint64_t low, uint64_t high);
+
+// True if ptr points into the mapped heap
+bool heap_contains(const void* ptr);
+
+// Bytes currently mapped
+uint64_t heap_get_size(void);
+
+// All counters are kept as the heap changes. Only the largest free block
+// may need a rescan, and only after the last block of its size was taken:
+// one size list with HEAP_TLSF, the whole free list without
+void heap_get_stats(heap_stats_t* stats);
+
+// "tlsf" when built with HEAP_TLSF, "first-fit" otherwise
+const char* heap_get_backend(void);
+
+uint64_t heap_get_used(void);
+uint64_t heap_get_free(void);
+
+#endif // __HEAP_H__
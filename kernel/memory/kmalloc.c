@@ -1,111 +1,425 @@
 #include "kmalloc.h"
+#include "slab.h"
+#include "kmem_cache.h"
+#include "kprof.h"
+#include "heap.h"
+#include "pmm.h"
+#include "page.h"
+#include "vmm.h"
 #include "../drivers/serial.h"
-#include <stdbool.h>
 
-// Memory block header
-typedef struct block_header {
-    size_t size;
-    bool is_free;
-    struct block_header* next;
-} block_header_t;
+// Powers of two and their midpoints; 24 is left out so every object stays
+// 16-byte aligned
+#define KMALLOC_MAX_CACHE_SIZE 4096
+#define KMALLOC_CLASS_STEP     16
 
-#define HEAP_START 0x180000
-#define HEAP_SIZE  0x80000
-#define BLOCK_HEADER_SIZE sizeof(block_header_t)
+static const uint32_t class_sizes[KMALLOC_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
 
-static block_header_t* heap_start = NULL;
-static uint64_t total_allocated = 0;
+// From here on requests go straight to contiguous PMM frames, reached
+// through the direct map; between the largest class and this, the heap
+#define KMALLOC_LARGE_MIN (4 * PAGE_SIZE)
 
-static size_t align_size(size_t size) {
-    return (size + 15) & ~15;
+// Side table of live large allocations, open addressing on the address.
+// Kept at most three quarters full; past that large requests use the heap
+#define LARGE_SLOTS_LOG2 9
+#define LARGE_SLOTS      (1 << LARGE_SLOTS_LOG2)
+#define LARGE_MAX_USED   (LARGE_SLOTS / 4 * 3)
+
+typedef struct large_alloc {
+    uint64_t addr;          // 0 for an empty slot
+    uint64_t pages;
+} large_alloc_t;
+
+static large_alloc_t large_table[LARGE_SLOTS];
+static uint32_t large_count = 0;
+static uint64_t large_pages = 0;
+
+static slab_cache_t size_caches[KMALLOC_CLASS_COUNT];
+
+// Size class for each 16-byte step up to KMALLOC_MAX_CACHE_SIZE
+static uint8_t class_index[KMALLOC_MAX_CACHE_SIZE / KMALLOC_CLASS_STEP];
+
+static inline uint32_t large_slot(uint64_t addr) {
+    return (uint32_t)(((addr / PAGE_SIZE) * 0x9E3779B97F4A7C15ULL) >> (64 - LARGE_SLOTS_LOG2));
+}
+
+static void large_insert(uint64_t addr, uint64_t pages) {
+    uint32_t slot = large_slot(addr);
+    while (large_table[slot].addr != 0) {
+        slot = (slot + 1) & (LARGE_SLOTS - 1);
+    }
+    large_table[slot].addr = addr;
+    large_table[slot].pages = pages;
+    large_count++;
+    large_pages += pages;
+}
+
+static large_alloc_t* large_find(uint64_t addr) {
+    uint32_t slot = large_slot(addr);
+    while (large_table[slot].addr != addr) {
+        if (large_table[slot].addr == 0) {
+            return NULL;
+        }
+        slot = (slot + 1) & (LARGE_SLOTS - 1);
+    }
+    return &large_table[slot];
+}
+
+// Removes addr from the table and returns its page count, or 0 if it is
+// not a large allocation
+static uint64_t large_remove(uint64_t addr) {
+    large_alloc_t* entry = large_find(addr);
+    if (entry == NULL) {
+        return 0;
+    }
+    uint32_t slot = (uint32_t)(entry - large_table);
+
+    uint64_t pages = entry->pages;
+    entry->addr = 0;
+    large_count--;
+    large_pages -= pages;
+
+    // Shift back later entries of the run that probed past the hole, so
+    // lookups never stop early
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & (LARGE_SLOTS - 1); large_table[next].addr != 0;
+         next = (next + 1) & (LARGE_SLOTS - 1)) {
+        uint32_t home = large_slot(large_table[next].addr);
+        if (((next - home) & (LARGE_SLOTS - 1)) >= ((next - hole) & (LARGE_SLOTS - 1))) {
+            large_table[hole].addr = large_table[next].addr;
+            large_table[hole].pages = large_table[next].pages;
+            large_table[next].addr = 0;
+            hole = next;
+        }
+    }
+    return pages;
+}
+
+static void* large_alloc(size_t size, size_t align) {
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t phys = pmm_alloc_contiguous(pages, align);
+    if (phys == 0) {
+        return NULL;
+    }
+    phys_to_page(phys)->type = PAGE_TYPE_KERNEL;
+
+    void* ptr = phys_to_virt(phys);
+    large_insert((uint64_t)ptr, pages);
+    return ptr;
+}
+
+static inline void copy_bytes(void* dest, const void* src, size_t count) {
+    __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(count) :: "memory");
+}
+
+static inline void zero_bytes(void* dest, size_t count) {
+    __asm__ volatile("rep stosb" : "+D"(dest), "+c"(count) : "a"(0) : "memory");
+}
+
+// PMM reclaim hook: trailing heap pages, then the objects cached in front
+// of the slabs and the spare empty slabs
+static void kmalloc_reclaim(void) {
+    heap_trim();
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        slab_cache_drain(&size_caches[i]);
+    }
+    kmem_cache_reap();
 }
 
 void kmalloc_init(void) {
-    heap_start = (block_header_t*)HEAP_START;
-    heap_start->size = HEAP_SIZE - BLOCK_HEADER_SIZE;
-    heap_start->is_free = true;
-    heap_start->next = NULL;
+    heap_init();
+    kmem_cache_init();
+    kprof_init();
+
+    for (uint32_t i = 0; i < LARGE_SLOTS; i++) {
+        large_table[i].addr = 0;
+    }
+    large_count = 0;
+    large_pages = 0;
+
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        slab_cache_init(&size_caches[i], class_sizes[i], KMALLOC_CLASS_STEP, NULL);
+    }
+
+    uint32_t class = 0;
+    for (uint32_t step = 0; step < KMALLOC_MAX_CACHE_SIZE / KMALLOC_CLASS_STEP; step++) {
+        while (class_sizes[class] < (step + 1) * KMALLOC_CLASS_STEP) {
+            class++;
+        }
+        class_index[step] = (uint8_t)class;
+    }
+
+    pmm_set_reclaim_hook(kmalloc_reclaim);
 
     serial_writestring("[KMALLOC] Kernel heap allocator initialized\n");
 }
 
-void* kmalloc(size_t size) {
+// The allocation paths below leave the profiler out; the exported entry
+// points call its hooks once per request, so kcalloc() and krealloc()
+// are not counted twice
+static void* allocate(size_t size) {
     if (size == 0) {
         return NULL;
     }
 
-    size = align_size(size);
+    if (size <= KMALLOC_MAX_CACHE_SIZE) {
+        return slab_alloc(&size_caches[class_index[(size - 1) / KMALLOC_CLASS_STEP]]);
+    }
 
-    block_header_t* current = heap_start;
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
+    if (size >= KMALLOC_LARGE_MIN && large_count < LARGE_MAX_USED) {
+        return large_alloc(size, 0);
+    }
+    return heap_alloc(size);
+}
 
-            if (current->size >= size + BLOCK_HEADER_SIZE + 16) {
-                block_header_t* new_block = (block_header_t*)((uint8_t*)current + BLOCK_HEADER_SIZE + size);
-                new_block->size = current->size - size - BLOCK_HEADER_SIZE;
-                new_block->is_free = true;
-                new_block->next = current->next;
+static void* allocate_zeroed(size_t total) {
+    if (total == 0) {
+        return NULL;
+    }
 
-                current->size = size;
-                current->next = new_block;
-            }
+    // A page-sized request takes a frame from the pre-zeroed pool and
+    // skips the clearing
+    if (total > PAGE_SIZE / 2 && total <= PAGE_SIZE && large_count < LARGE_MAX_USED) {
+        uint64_t phys = pmm_alloc_zeroed_page();
+        if (phys != 0) {
+            phys_to_page(phys)->type = PAGE_TYPE_KERNEL;
+            void* ptr = phys_to_virt(phys);
+            large_insert((uint64_t)ptr, 1);
+            return ptr;
+        }
+    }
 
-            current->is_free = false;
-            total_allocated += current->size;
+    void* ptr = allocate(total);
+    if (ptr != NULL) {
+        zero_bytes(ptr, total);
+    }
+    return ptr;
+}
 
-            return (void*)((uint8_t*)current + BLOCK_HEADER_SIZE);
-        }
+static void* allocate_aligned(size_t size, size_t align) {
+    if (size == 0 || align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= KMALLOC_CLASS_STEP) {
+        return allocate(size);
+    }
 
-        current = current->next;
+    // Slabs start their objects on a cache line, so a class that is a
+    // multiple of align only holds aligned objects
+    if (align <= CACHE_LINE_SIZE && size <= KMALLOC_MAX_CACHE_SIZE) {
+        for (uint32_t class = class_index[(size - 1) / KMALLOC_CLASS_STEP]; class < KMALLOC_CLASS_COUNT; class++) {
+            if (class_sizes[class] % align == 0) {
+                return slab_alloc(&size_caches[class]);
+            }
+        }
     }
 
-    return NULL;
+    if ((align >= PAGE_SIZE || size >= KMALLOC_LARGE_MIN) && large_count < LARGE_MAX_USED) {
+        return large_alloc(size, align);
+    }
+    return heap_alloc_aligned(size, align);
 }
 
-void kfree(void* ptr) {
+static void release(void* ptr) {
     if (ptr == NULL) {
         return;
     }
 
-    block_header_t* block = (block_header_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
-
-    if (block->is_free) {
+    if (heap_contains(ptr)) {
+        heap_free(ptr);
+        return;
+    }
+    if (slab_cache_of(ptr) != NULL) {
+        slab_free(ptr);
         return;
     }
 
-    block->is_free = true;
-    total_allocated -= block->size;
+    uint64_t pages = large_remove((uint64_t)ptr);
+    if (pages != 0) {
+        pmm_free_contiguous((uint64_t)ptr - vmm_direct_map_offset, pages);
+    } else {
+        serial_writestring("[KMALLOC] kfree() of a pointer kmalloc() did not return\n");
+    }
+}
 
-    if (block->next != NULL && block->next->is_free) {
-        block->size += BLOCK_HEADER_SIZE + block->next->size;
-        block->next = block->next->next;
+static void* reallocate(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return allocate(size);
+    }
+    if (size == 0) {
+        release(ptr);
+        return NULL;
     }
 
-    block_header_t* current = heap_start;
-    while (current != NULL && current->next != block) {
-        current = current->next;
+    size_t old_size;
+    slab_cache_t* cache;
+    if (heap_contains(ptr)) {
+        if (heap_resize(ptr, size)) {
+            return ptr;
+        }
+        old_size = heap_usable_size(ptr);
+    } else if ((cache = slab_cache_of(ptr)) != NULL) {
+        old_size = cache->object_size;
+        if (size <= old_size) {
+            return ptr;
+        }
+    } else {
+        large_alloc_t* entry = large_find((uint64_t)ptr);
+        if (entry == NULL) {
+            serial_writestring("[KMALLOC] krealloc() of a pointer kmalloc() did not return\n");
+            return NULL;
+        }
+
+        // Shrinks in place by handing the tail frames back
+        uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (pages <= entry->pages) {
+            uint64_t phys = (uint64_t)ptr - vmm_direct_map_offset;
+            if (!pmm_shrink_contiguous(phys, entry->pages, pages)) {
+                return NULL;
+            }
+            large_pages -= entry->pages - pages;
+            entry->pages = pages;
+            return ptr;
+        }
+        old_size = entry->pages * PAGE_SIZE;
     }
 
-    if (current != NULL && current->is_free) {
-        current->size += BLOCK_HEADER_SIZE + block->size;
-        current->next = block->next;
+    void* fresh = allocate(size);
+    if (fresh == NULL) {
+        return NULL;
+    }
+    copy_bytes(fresh, ptr, old_size < size ? old_size : size);
+    release(ptr);
+    return fresh;
+}
+
+void* kmalloc(size_t size) {
+    void* ptr = allocate(size);
+    kprof_alloc_hook(ptr, size, __builtin_frame_address(0));
+    return ptr;
+}
+
+void* kcalloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
     }
+    void* ptr = allocate_zeroed(count * size);
+    kprof_alloc_hook(ptr, count * size, __builtin_frame_address(0));
+    return ptr;
+}
+
+void* kmalloc_aligned(size_t size, size_t align) {
+    void* ptr = allocate_aligned(size, align);
+    kprof_alloc_hook(ptr, size, __builtin_frame_address(0));
+    return ptr;
+}
+
+// Resizing in place counts as a free and a new allocation too
+void* krealloc(void* ptr, size_t size) {
+    void* fresh = reallocate(ptr, size);
+    if (fresh != NULL || size == 0) {
+        kprof_free_hook(ptr);
+        kprof_alloc_hook(fresh, size, __builtin_frame_address(0));
+    }
+    return fresh;
+}
+
+void kfree(void* ptr) {
+    kprof_free_hook(ptr);
+    release(ptr);
 }
 
 uint64_t kmalloc_get_used(void) {
-    return total_allocated;
+    uint64_t used = heap_get_used() + large_pages * PAGE_SIZE;
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        slab_stats_t stats;
+        slab_cache_get_stats(&size_caches[i], &stats);
+        used += stats.active_objects * size_caches[i].object_size;
+    }
+    return used;
 }
 
+// Objects parked in the per-CPU caches count as free
 uint64_t kmalloc_get_free(void) {
-    uint64_t free_memory = 0;
-    block_header_t* current = heap_start;
+    uint64_t free_memory = heap_get_free();
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        slab_stats_t stats;
+        slab_cache_get_stats(&size_caches[i], &stats);
+        free_memory += (stats.total_objects - stats.active_objects) * size_caches[i].object_size;
+    }
+    return free_memory;
+}
+
+void kmalloc_stats(kmalloc_stats_t* stats) {
+    stats->used_bytes = kmalloc_get_used();
+    stats->free_bytes = kmalloc_get_free();
 
-    while (current != NULL) {
-        if (current->is_free) {
-            free_memory += current->size;
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        slab_stats_t slab;
+        slab_cache_get_stats(&size_caches[i], &slab);
+        stats->class_size[i] = class_sizes[i];
+        stats->class_live[i] = slab.active_objects;
+    }
+
+    stats->large_allocs = large_count;
+    stats->large_pages = large_pages;
+
+    heap_get_stats(&stats->heap);
+    stats->fragmentation = 0;
+    if (stats->heap.free_bytes != 0) {
+        stats->fragmentation = (uint32_t)(1000 - stats->heap.largest_free * 1000 / stats->heap.free_bytes);
+    }
+}
+
+void kmalloc_stats_dump(void) {
+    kmalloc_stats_t stats;
+    kmalloc_stats(&stats);
+
+    serial_writestring("[KMALLOC] Used ");
+    serial_writedec(stats.used_bytes);
+    serial_writestring(" bytes, free ");
+    serial_writedec(stats.free_bytes);
+    serial_writestring(" bytes\n");
+
+    for (uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        if (stats.class_live[i] == 0) {
+            continue;
         }
-        current = current->next;
+        serial_writestring("[KMALLOC]   ");
+        serial_writedec(stats.class_size[i]);
+        serial_writestring(" bytes: ");
+        serial_writedec(stats.class_live[i]);
+        serial_writestring(" live\n");
     }
 
-    return free_memory;
+    serial_writestring("[KMALLOC] Large: ");
+    serial_writedec(stats.large_allocs);
+    serial_writestring(" allocations, ");
+    serial_writedec(stats.large_pages);
+    serial_writestring(" pages\n");
+
+    serial_writestring("[KMALLOC] Heap: ");
+    serial_writedec(stats.heap.size);
+    serial_writestring(" bytes mapped, ");
+    serial_writedec(stats.heap.free_blocks);
+    serial_writestring(" free blocks, largest ");
+    serial_writedec(stats.heap.largest_free);
+    serial_writestring(" bytes, fragmentation ");
+    serial_writedec(stats.fragmentation / 10);
+    serial_writestring(".");
+    serial_writedec(stats.fragmentation % 10);
+    serial_writestring("%\n");
+
+    for (uint32_t i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        if (stats.heap.free_histogram[i] == 0) {
+            continue;
+        }
+        serial_writestring("[KMALLOC]   free extents from ");
+        serial_writedec(1ULL << i);
+        serial_writestring(" bytes: ");
+        serial_writedec(stats.heap.free_histogram[i]);
+        serial_writestring("\n");
+    }
 }
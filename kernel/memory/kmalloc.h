@@ -4,12 +4,48 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "heap.h"
 
+#define KMALLOC_CLASS_COUNT 16
+
+typedef struct kmalloc_stats {
+    uint64_t used_bytes;
+    uint64_t free_bytes;
+    uint32_t class_size[KMALLOC_CLASS_COUNT];
+    uint64_t class_live[KMALLOC_CLASS_COUNT];   // objects held by callers
+    uint64_t large_allocs;
+    uint64_t large_pages;
+    // External fragmentation of the heap in per mille: the share of its
+    // free bytes outside the largest free block
+    uint32_t fragmentation;
+    heap_stats_t heap;
+} kmalloc_stats_t;
+
+// Every entry point below is seen by the sampling profiler in kprof.h
 void kmalloc_init(void);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 
+// Zero-filled; NULL if count * size overflows
+void* kcalloc(size_t count, size_t size);
+
+// align is a power of two. Cache-line alignment comes from a size class
+// that keeps it, page alignment from whole frames
+void* kmalloc_aligned(size_t size, size_t align);
+
+// Grows or shrinks in place where the allocator can, otherwise moves the
+// contents. On failure ptr is left as it was and NULL is returned
+void* krealloc(void* ptr, size_t size);
+
 uint64_t kmalloc_get_used(void);
 uint64_t kmalloc_get_free(void);
 
+// A snapshot from running counters, like heap_get_stats(): only the
+// largest free heap block may need a rescan, which is a full free-list
+// walk without HEAP_TLSF
+void kmalloc_stats(kmalloc_stats_t* stats);
+
+// kmalloc_stats() to the serial port
+void kmalloc_stats_dump(void);
+
 #endif // __KMALLOC_H__
@@ -0,0 +1,117 @@
+#include "kmem_cache.h"
+#include "../drivers/serial.h"
+
+// The caches themselves come from a statically set up cache
+static kmem_cache_t cache_cache;
+static kmem_cache_t* caches = NULL;
+
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align,
+                        kmem_ctor_t ctor) {
+    cache->name = name;
+    cache->size = (uint32_t)size;
+    slab_cache_init(&cache->slab, (uint32_t)size, (uint32_t)align, ctor);
+
+    cache->next = caches;
+    caches = cache;
+}
+
+void kmem_cache_init(void) {
+    caches = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), KMEM_CACHE_DEFAULT_ALIGN, NULL);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (align == 0) {
+        align = KMEM_CACHE_DEFAULT_ALIGN;
+    }
+    if (size == 0 || size > KMEM_CACHE_MAX_SIZE || align > PAGE_SIZE || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+
+    kmem_cache_t* cache = (kmem_cache_t*)slab_alloc(&cache_cache.slab);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+bool kmem_cache_destroy(kmem_cache_t* cache) {
+    if (cache == NULL) {
+        return true;
+    }
+
+    slab_cache_drain(&cache->slab);
+    if (cache->slab.active_objects != 0) {
+        serial_writestring("[KMEM] Cannot destroy ");
+        serial_writestring(cache->name);
+        serial_writestring(", objects still allocated\n");
+        return false;
+    }
+
+    kmem_cache_t** link = &caches;
+    while (*link != cache) {
+        link = &(*link)->next;
+    }
+    *link = cache->next;
+
+    slab_free(cache);
+    return true;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    return slab_alloc(&cache->slab);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    if (object == NULL) {
+        return;
+    }
+    if (slab_cache_of(object) != &cache->slab) {
+        serial_writestring("[KMEM] Object freed to ");
+        serial_writestring(cache->name);
+        serial_writestring(" belongs to another cache\n");
+        return;
+    }
+    slab_free(object);
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    slab_stats_t slab;
+    slab_cache_get_stats(&cache->slab, &slab);
+
+    stats->object_size = cache->slab.object_size;
+    stats->active_objects = slab.active_objects;
+    stats->total_objects = slab.total_objects;
+    stats->slabs = cache->slab.slabs;
+    stats->allocs = slab.allocs;
+    stats->frees = slab.frees;
+    stats->hits = slab.allocs > slab.refills ? slab.allocs - slab.refills : 0;
+}
+
+void kmem_cache_reap(void) {
+    for (kmem_cache_t* cache = caches; cache != NULL; cache = cache->next) {
+        slab_cache_drain(&cache->slab);
+    }
+}
+
+void kmem_cache_dump(void) {
+    for (kmem_cache_t* cache = caches; cache != NULL; cache = cache->next) {
+        kmem_cache_stats_t stats;
+        kmem_cache_get_stats(cache, &stats);
+
+        serial_writestring("[KMEM] ");
+        serial_writestring(cache->name);
+        serial_writestring(": ");
+        serial_writedec(stats.active_objects);
+        serial_writestring("/");
+        serial_writedec(stats.total_objects);
+        serial_writestring(" objects of ");
+        serial_writedec(stats.object_size);
+        serial_writestring(" bytes, ");
+        serial_writedec(stats.slabs);
+        serial_writestring(" slabs, ");
+        serial_writedec(stats.allocs ? stats.hits * 100 / stats.allocs : 0);
+        serial_writestring("% per-CPU hits\n");
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef __KMEM_CACHE_H__
+#define __KMEM_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pmm.h"
+#include "slab.h"
+
+// Typed object caches for hot fixed-size kernel objects. Each has its own
+// slabs, so objects of one type share pages, and its own per-CPU caches
+
+// Alignment used when kmem_cache_create() is passed 0
+#define KMEM_CACHE_DEFAULT_ALIGN CACHE_LINE_SIZE
+
+// Largest object a cache takes
+#define KMEM_CACHE_MAX_SIZE PAGE_SIZE
+
+typedef void (*kmem_ctor_t)(void* object);
+
+typedef struct kmem_cache {
+    const char* name;
+    uint32_t size;          // as requested
+    slab_cache_t slab;
+    struct kmem_cache* next;
+} kmem_cache_t;
+
+typedef struct kmem_cache_stats {
+    uint64_t object_size;   // bytes per object in the slabs, padding included
+    uint64_t active_objects;
+    uint64_t total_objects;
+    uint64_t slabs;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;          // allocations served by a per-CPU cache
+} kmem_cache_stats_t;
+
+// Called by kmalloc_init()
+void kmem_cache_init(void);
+
+// name must outlive the cache. align is a power of two up to a page, or 0
+// for KMEM_CACHE_DEFAULT_ALIGN. With a ctor, objects come back from
+// kmem_cache_alloc() constructed, and must be freed in that state.
+// Returns NULL on bad arguments or out of memory
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+
+// Fails and keeps the cache while any of its objects are still allocated
+bool kmem_cache_destroy(kmem_cache_t* cache);
+
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+
+// Drains every cache's per-CPU objects and frees its spare empty slab
+void kmem_cache_reap(void);
+
+// One line per cache to the serial port
+void kmem_cache_dump(void);
+
+#endif // __KMEM_CACHE_H__
@@ -0,0 +1,364 @@
+#include "kprof.h"
+#include "../cpu/cpu.h"
+#include "../drivers/serial.h"
+
+// How far above the kmalloc() frame a caller's frame may sit. Anything
+// further up is the garbage the loader left in rbp, not a frame
+#define KPROF_STACK_SPAN (64 * 1024)
+
+#define KPROF_SAMPLES_MAX_USED (KPROF_SAMPLES / 4 * 3)
+
+// ln 2 and log2 e in 16.16 fixed point
+#define LN2_Q16   45426
+#define LOG2E_Q16 94548
+
+typedef struct kprof_site {
+    uint64_t pcs[KPROF_DEPTH];
+    uint32_t depth;         // 0 for an empty slot
+    uint32_t live_count;
+    uint64_t live_bytes;    // as requested
+    uint64_t live_weight;   // estimated, see kprof.h
+    uint64_t samples;
+} kprof_site_t;
+
+typedef struct kprof_sample {
+    uint64_t addr;          // 0 for an empty slot
+    uint64_t size;
+    uint64_t weight;
+    uint32_t site;
+} kprof_sample_t;
+
+// 2^(-2^-(k+1)) in 0.32 fixed point
+static const uint32_t exp2_neg_steps[16] = {
+    0xB504F334, 0xD744FCCB, 0xEAC0C6E8, 0xF5257D15, 0xFA83B2DB, 0xFD3E0C0D, 0xFE9E115C, 0xFF4ECB59,
+    0xFFA75652, 0xFFD3A752, 0xFFE9D2B3, 0xFFF4E91C, 0xFFFA747F, 0xFFFD3A3B, 0xFFFE9D1D, 0xFFFF4E8E
+};
+
+int64_t kprof_bytes_until_sample = INT64_MAX;
+uint32_t kprof_live_samples = 0;
+
+static kprof_site_t sites[KPROF_SITES];
+static kprof_sample_t samples[KPROF_SAMPLES];
+
+static uint64_t sample_rate = 0;
+static uint64_t random_state = 1;
+static uint64_t samples_taken = 0;
+static uint64_t samples_dropped = 0;
+static uint64_t live_weight = 0;
+static uint32_t site_count = 0;
+
+static uint64_t next_random(void) {
+    uint64_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    random_state = x;
+    return x;
+}
+
+// -log2(x / 2^32) in 16.16 fixed point, for x from 1 to 2^32 - 1. The
+// fraction bits come from repeated squaring of the mantissa
+static uint64_t neg_log2_q16(uint32_t x) {
+    uint32_t exponent = 63 - __builtin_clzll(x);
+    uint64_t mantissa = (uint64_t)x << (31 - exponent);    // 1.31
+    uint64_t log2 = (uint64_t)exponent << 16;
+
+    for (uint32_t bit = 16; bit-- > 0;) {
+        mantissa = (mantissa * mantissa) >> 31;
+        if (mantissa >= (1ULL << 32)) {
+            mantissa >>= 1;
+            log2 |= 1ULL << bit;
+        }
+    }
+    return (32ULL << 16) - log2;
+}
+
+// e^(-x) for x in 16.16 fixed point, as 2^(-x log2 e)
+static uint64_t exp_neg_q16(uint64_t x) {
+    uint64_t y = (x * LOG2E_Q16) >> 16;
+    if ((y >> 16) >= 32) {
+        return 0;
+    }
+
+    uint64_t result = (1ULL << 32) >> (y >> 16);            // 0.32
+    for (uint32_t k = 0; k < 16; k++) {
+        if (y & (1ULL << (15 - k))) {
+            result = (result * exp2_neg_steps[k]) >> 32;
+        }
+    }
+    return result >> 16;
+}
+
+// Bytes until the next sample: exponentially distributed with mean
+// sample_rate, which makes the sampled bytes a Poisson process
+static int64_t next_interval(void) {
+    uint32_t x = (uint32_t)(next_random() >> 32) | 1;
+    uint64_t ln_q16 = (neg_log2_q16(x) * LN2_Q16) >> 16;
+    return (int64_t)((sample_rate * ln_q16) >> 16) + 1;
+}
+
+// size / (1 - e^(-size / rate)): the bytes one sample of size stands for
+static uint64_t sample_weight(uint64_t size) {
+    uint64_t x = (size << 16) / sample_rate;
+    if (x >= (32ULL << 16)) {
+        return size;
+    }
+    uint64_t denominator = (1ULL << 16) - exp_neg_q16(x);
+    if (denominator == 0) {
+        return sample_rate;
+    }
+    return (size << 16) / denominator;
+}
+
+// Walks the frame pointer chain from the kmalloc() entry point. Every
+// function keeps its frame pointer, as the kernel is built unoptimised
+static uint32_t capture_stack(void* frame, uint64_t* pcs) {
+    uint64_t* fp = (uint64_t*)frame;
+    uint64_t base = (uint64_t)frame;
+    uint32_t depth = 0;
+
+    while (depth < KPROF_DEPTH && fp[1] != 0) {
+        pcs[depth++] = fp[1];
+
+        uint64_t* next = (uint64_t*)fp[0];
+        if ((uint64_t)next <= (uint64_t)fp || (uint64_t)next - base > KPROF_STACK_SPAN ||
+            ((uint64_t)next & 7) != 0) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+static uint32_t stack_hash(const uint64_t* pcs, uint32_t depth) {
+    uint64_t hash = depth;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ pcs[i]) * 0x9E3779B97F4A7C15ULL;
+    }
+    return (uint32_t)(hash >> 32);
+}
+
+static bool same_stack(const kprof_site_t* site, const uint64_t* pcs, uint32_t depth) {
+    if (site->depth != depth) {
+        return false;
+    }
+    for (uint32_t i = 0; i < depth; i++) {
+        if (site->pcs[i] != pcs[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sites are never removed, only emptied, so a full table stays full until
+// the next kprof_start()
+static kprof_site_t* site_lookup(const uint64_t* pcs, uint32_t depth) {
+    uint32_t slot = stack_hash(pcs, depth) & (KPROF_SITES - 1);
+    for (uint32_t probes = 0; probes < KPROF_SITES; probes++) {
+        kprof_site_t* site = &sites[slot];
+        if (site->depth == 0) {
+            for (uint32_t i = 0; i < depth; i++) {
+                site->pcs[i] = pcs[i];
+            }
+            site->depth = depth;
+            site_count++;
+            return site;
+        }
+        if (same_stack(site, pcs, depth)) {
+            return site;
+        }
+        slot = (slot + 1) & (KPROF_SITES - 1);
+    }
+    return NULL;
+}
+
+static inline uint32_t sample_slot(uint64_t addr) {
+    return (uint32_t)(((addr >> 4) * 0x9E3779B97F4A7C15ULL) >> (64 - KPROF_SAMPLES_LOG2));
+}
+
+static void sample_insert(uint64_t addr, uint64_t size, uint64_t weight, uint32_t site) {
+    uint32_t slot = sample_slot(addr);
+    while (samples[slot].addr != 0) {
+        slot = (slot + 1) & (KPROF_SAMPLES - 1);
+    }
+    samples[slot].addr = addr;
+    samples[slot].size = size;
+    samples[slot].weight = weight;
+    samples[slot].site = site;
+    kprof_live_samples++;
+}
+
+// Same backward shift deletion as the kmalloc large table
+static void sample_remove(uint32_t slot) {
+    samples[slot].addr = 0;
+    kprof_live_samples--;
+
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & (KPROF_SAMPLES - 1); samples[next].addr != 0;
+         next = (next + 1) & (KPROF_SAMPLES - 1)) {
+        uint32_t home = sample_slot(samples[next].addr);
+        if (((next - home) & (KPROF_SAMPLES - 1)) >= ((next - hole) & (KPROF_SAMPLES - 1))) {
+            samples[hole].addr = samples[next].addr;
+            samples[hole].size = samples[next].size;
+            samples[hole].weight = samples[next].weight;
+            samples[hole].site = samples[next].site;
+            samples[next].addr = 0;
+            hole = next;
+        }
+    }
+}
+
+static void profile_reset(void) {
+    for (uint32_t i = 0; i < KPROF_SITES; i++) {
+        sites[i].depth = 0;
+        sites[i].live_count = 0;
+        sites[i].live_bytes = 0;
+        sites[i].live_weight = 0;
+        sites[i].samples = 0;
+    }
+    for (uint32_t i = 0; i < KPROF_SAMPLES; i++) {
+        samples[i].addr = 0;
+    }
+    kprof_live_samples = 0;
+    samples_taken = 0;
+    samples_dropped = 0;
+    live_weight = 0;
+    site_count = 0;
+}
+
+void kprof_init(void) {
+    sample_rate = 0;
+    kprof_bytes_until_sample = INT64_MAX;
+    profile_reset();
+}
+
+void kprof_start(uint64_t rate) {
+    uint64_t flags = cpu_irq_save();
+
+    profile_reset();
+    sample_rate = rate != 0 ? rate : KPROF_DEFAULT_RATE;
+    random_state = cpu_rdtsc() | 1;
+    kprof_bytes_until_sample = next_interval();
+
+    cpu_irq_restore(flags);
+}
+
+void kprof_stop(void) {
+    uint64_t flags = cpu_irq_save();
+    sample_rate = 0;
+    kprof_bytes_until_sample = INT64_MAX;
+    cpu_irq_restore(flags);
+}
+
+void kprof_record(void* ptr, size_t size, void* frame) {
+    uint64_t flags = cpu_irq_save();
+
+    if (sample_rate == 0) {
+        kprof_bytes_until_sample = INT64_MAX;
+        cpu_irq_restore(flags);
+        return;
+    }
+    kprof_bytes_until_sample = next_interval();
+    samples_taken++;
+
+    uint64_t pcs[KPROF_DEPTH];
+    uint32_t depth = capture_stack(frame, pcs);
+    kprof_site_t* site = NULL;
+    if (depth != 0 && kprof_live_samples < KPROF_SAMPLES_MAX_USED) {
+        site = site_lookup(pcs, depth);
+    }
+    if (site == NULL) {
+        samples_dropped++;
+        cpu_irq_restore(flags);
+        return;
+    }
+
+    uint64_t weight = sample_weight(size);
+    sample_insert((uint64_t)ptr, size, weight, (uint32_t)(site - sites));
+    site->live_count++;
+    site->live_bytes += size;
+    site->live_weight += weight;
+    site->samples++;
+    live_weight += weight;
+
+    cpu_irq_restore(flags);
+}
+
+void kprof_forget(void* ptr) {
+    uint64_t flags = cpu_irq_save();
+
+    uint32_t slot = sample_slot((uint64_t)ptr);
+    while (samples[slot].addr != (uint64_t)ptr) {
+        if (samples[slot].addr == 0) {
+            cpu_irq_restore(flags);
+            return;
+        }
+        slot = (slot + 1) & (KPROF_SAMPLES - 1);
+    }
+
+    kprof_site_t* site = &sites[samples[slot].site];
+    site->live_count--;
+    site->live_bytes -= samples[slot].size;
+    site->live_weight -= samples[slot].weight;
+    live_weight -= samples[slot].weight;
+    sample_remove(slot);
+
+    cpu_irq_restore(flags);
+}
+
+void kprof_get_stats(kprof_stats_t* stats) {
+    stats->rate = sample_rate;
+    stats->samples = samples_taken;
+    stats->live_samples = kprof_live_samples;
+    stats->live_bytes = live_weight;
+    stats->dropped = samples_dropped;
+    stats->sites = site_count;
+}
+
+void kprof_dump(void) {
+    kprof_stats_t stats;
+    kprof_get_stats(&stats);
+
+    serial_writestring("[KPROF] Rate ");
+    serial_writedec(stats.rate);
+    serial_writestring(" bytes, ");
+    serial_writedec(stats.samples);
+    serial_writestring(" samples, ");
+    serial_writedec(stats.live_samples);
+    serial_writestring(" live, ~");
+    serial_writedec(stats.live_bytes);
+    serial_writestring(" bytes live, ");
+    serial_writedec(stats.dropped);
+    serial_writestring(" dropped\n");
+
+    // Sites holding live samples, largest estimate first
+    uint16_t order[KPROF_SITES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < KPROF_SITES; i++) {
+        if (sites[i].live_count == 0) {
+            continue;
+        }
+        uint32_t j = count++;
+        while (j > 0 && sites[order[j - 1]].live_weight < sites[i].live_weight) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = (uint16_t)i;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        kprof_site_t* site = &sites[order[i]];
+        serial_writestring("[KPROF]   ~");
+        serial_writedec(site->live_weight);
+        serial_writestring(" bytes, ");
+        serial_writedec(site->live_count);
+        serial_writestring(" sampled (");
+        serial_writedec(site->live_bytes);
+        serial_writestring(" bytes) at");
+        for (uint32_t d = 0; d < site->depth; d++) {
+            serial_writestring(" ");
+            serial_writehex(site->pcs[d]);
+        }
+        serial_writestring("\n");
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef __KPROF_H__
+#define __KPROF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sampling profiler for kmalloc(). Allocated bytes are sampled as a
+// Poisson process, so on average one sample is taken every rate bytes and
+// an allocation of size bytes is sampled with probability
+// 1 - e^(-size / rate). Each sample records the caller's return addresses
+// and is weighted by the inverse of that probability, which makes the
+// per-call-site byte counts unbiased estimates of what the site holds
+
+// Return addresses kept per sample, innermost first
+#define KPROF_DEPTH 6
+
+// Distinct call stacks; samples from further stacks are dropped
+#define KPROF_SITES_LOG2 8
+#define KPROF_SITES      (1 << KPROF_SITES_LOG2)
+
+// Live sampled objects, kept at most three quarters full
+#define KPROF_SAMPLES_LOG2 10
+#define KPROF_SAMPLES      (1 << KPROF_SAMPLES_LOG2)
+
+// Mean bytes between samples for kprof_start(0)
+#define KPROF_DEFAULT_RATE (512 * 1024)
+
+// Bytes kmalloc() may still hand out before the next sample. Only the
+// inline hooks below touch it on the allocation path
+extern int64_t kprof_bytes_until_sample;
+
+// Sampled objects not freed yet; kfree() skips the lookup while it is 0
+extern uint32_t kprof_live_samples;
+
+typedef struct kprof_stats {
+    uint64_t rate;          // 0 while stopped
+    uint64_t samples;       // taken since kprof_start()
+    uint64_t live_samples;
+    uint64_t live_bytes;    // estimated bytes held by sampled call sites
+    uint64_t dropped;       // samples lost to a full table
+    uint32_t sites;
+} kprof_stats_t;
+
+// Called by kmalloc_init(); profiling starts stopped
+void kprof_init(void);
+
+// Starts sampling every rate bytes on average, or KPROF_DEFAULT_RATE for 0.
+// Clears the previous profile
+void kprof_start(uint64_t rate);
+
+// Takes no further samples. Frees of sampled objects are still tracked,
+// so the live profile stays right
+void kprof_stop(void);
+
+// Slow paths of the hooks below. frame is the frame pointer of the
+// kmalloc() entry point the caller called
+void kprof_record(void* ptr, size_t size, void* frame);
+void kprof_forget(void* ptr);
+
+void kprof_get_stats(kprof_stats_t* stats);
+
+// The live profile to the serial port, largest call sites first
+void kprof_dump(void);
+
+static inline void kprof_alloc_hook(void* ptr, size_t size, void* frame) {
+    kprof_bytes_until_sample -= (int64_t)size;
+    if (kprof_bytes_until_sample <= 0 && ptr != NULL) {
+        kprof_record(ptr, size, frame);
+    }
+}
+
+static inline void kprof_free_hook(void* ptr) {
+    if (kprof_live_samples != 0 && ptr != NULL) {
+        kprof_forget(ptr);
+    }
+}
+
+#endif // __KPROF_H__
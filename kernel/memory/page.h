@@ -0,0 +1,68 @@
+#ifndef __PAGE_H__
+#define __PAGE_H__
+
+#include <stdint.h>
+
+#include "pmm.h"
+
+#define PAGE_INDEX_NONE 0xFFFFFFFF
+
+// page_t.flags
+#define PAGE_FLAG_BUDDY    (1 << 0)  // head of a free block on a buddy list
+#define PAGE_FLAG_PCP      (1 << 1)  // parked in a per-CPU frame cache
+#define PAGE_FLAG_RESERVED (1 << 2)  // firmware, kernel image or PMM metadata
+#define PAGE_FLAG_HEAD     (1 << 3)  // first frame of a multi-page allocation
+
+// page_t.type, set by whoever owns an allocated frame
+#define PAGE_TYPE_NONE      0
+#define PAGE_TYPE_KERNEL    1
+#define PAGE_TYPE_PAGETABLE 2
+#define PAGE_TYPE_SLAB      3
+#define PAGE_TYPE_HEAP      4
+#define PAGE_TYPE_ANON      5
+
+// One descriptor per physical frame, 32 bytes so two share a cache line
+// (0.8% of RAM). Links are frame indices rather than pointers to keep it
+// that small.
+typedef struct page {
+    uint16_t flags;
+    uint8_t type;
+    uint8_t order;          // buddy order of a free block
+    uint32_t frames;        // frames in the allocation, on its head
+    int32_t refcount;
+    uint32_t head;          // index of the compound head, or of the frame itself
+    uint32_t lru_next;      // buddy free list while free, LRU list while in use
+    uint32_t lru_prev;
+    uint64_t private;       // owner-specific data
+} page_t;
+
+_Static_assert(sizeof(page_t) == 32, "page_t must stay 32 bytes");
+
+extern page_t* page_array;
+
+static inline page_t* phys_to_page(uint64_t phys) {
+    return &page_array[phys / PAGE_SIZE];
+}
+
+static inline uint64_t page_to_phys(const page_t* page) {
+    return (uint64_t)(page - page_array) * PAGE_SIZE;
+}
+
+static inline uint64_t page_to_index(const page_t* page) {
+    return (uint64_t)(page - page_array);
+}
+
+static inline page_t* page_compound_head(const page_t* page) {
+    return &page_array[page->head];
+}
+
+static inline void page_ref_inc(page_t* page) {
+    page->refcount++;
+}
+
+// Returns the remaining reference count
+static inline int32_t page_ref_dec(page_t* page) {
+    return --page->refcount;
+}
+
+#endif // __PAGE_H__
@@ -1,100 +1,996 @@
 #include "pmm.h"
+#include "page.h"
+#include "vmm.h"
 #include "../drivers/serial.h"
+#include "../cpu/cpu.h"
 
-static uint8_t* page_bitmap = NULL;
+// Stage2 identity-maps the first 1GB, so PMM metadata has to live below it
+#define PMM_IDENTITY_LIMIT  0x40000000ULL
+// Low memory and the kernel image
+#define PMM_KERNEL_END      0x200000ULL
+// Assumed when the bootloader did not provide an E820 map
+#define PMM_FALLBACK_MEMORY (64ULL * 1024 * 1024)
+
+#define BITS_PER_WORD   64
+#define PAGE_NONE       (~0ULL)
+
+// Per-CPU frame caches refill from and drain to the buddy lists in batches
+#define PCP_BATCH    32
+#define PCP_HIGH     64
+#define PCP_MASK     (PCP_HIGH - 1)
+
+// Frames kept zeroed ahead of time for pmm_alloc_zeroed_page(); the idle
+// loop tops the pool up a batch at a time
+#define ZERO_POOL_SIZE  64
+#define ZERO_POOL_BATCH 16
+
+// A ring of single frames owned by one CPU. The hot end (head) gets recently
+// freed, cache-warm frames and serves allocations; the cold end takes
+// pmm_free_page_cold() frames and is what gets drained.
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) pmm_pcp {
+    uint32_t head;
+    uint32_t count;
+    uint32_t frames[PCP_HIGH];
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t refills;
+    uint64_t drains;
+    uint64_t frees;
+} pmm_pcp_t;
+
+static pmm_pcp_t pcp_caches[MAX_CPUS];
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+page_t* page_array = NULL;
+
+static uint64_t* page_bitmap = NULL;
+static uint64_t* summary_bitmap = NULL;
+static uint64_t bitmap_words = 0;
+static uint32_t free_lists[PMM_MAX_ORDER + 1];
+static uint64_t free_blocks[PMM_MAX_ORDER + 1];
+static uint64_t alloc_failures[PMM_MAX_ORDER + 1];
+static uint64_t fragmentation_failures = 0;
+static pmm_reclaim_t reclaim_hook = NULL;
+static bool reclaiming = false;
+static uint64_t reclaims = 0;
+static const e820_entry_t* memory_map = NULL;
+static uint32_t memory_map_count = 0;
+static uint64_t max_pages = 0;
 static uint64_t total_pages = 0;
 static uint64_t used_pages = 0;
 
-static inline uint64_t page_to_byte(uint64_t page) {
-    return page / PAGES_PER_BYTE;
+static inline uint64_t page_to_word(uint64_t page) {
+    return page / BITS_PER_WORD;
+}
+
+static inline uint64_t page_to_bit(uint64_t page) {
+    return page % BITS_PER_WORD;
 }
 
-static inline uint8_t page_to_bit(uint64_t page) {
-    return page % PAGES_PER_BYTE;
+// The summary keeps one bit per bitmap word, set while that word is full
+static inline void update_summary(uint64_t word) {
+    uint64_t mask = 1ULL << page_to_bit(word);
+    if (page_bitmap[word] == ~0ULL) {
+        summary_bitmap[page_to_word(word)] |= mask;
+    } else {
+        summary_bitmap[page_to_word(word)] &= ~mask;
+    }
 }
 
 static bool is_page_allocated(uint64_t page) {
-    uint64_t byte = page_to_byte(page);
-    uint8_t bit = page_to_bit(page);
-    return (page_bitmap[byte] & (1 << bit)) != 0;
+    return (page_bitmap[page_to_word(page)] & (1ULL << page_to_bit(page))) != 0;
+}
+
+// Mask of the bits [first, first + count) within a single word
+static inline uint64_t word_mask(uint64_t first, uint64_t count) {
+    uint64_t mask = count >= BITS_PER_WORD ? ~0ULL : (1ULL << count) - 1;
+    return mask << first;
+}
+
+static void set_range_allocated(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t word = page_to_word(page);
+        uint64_t bit = page_to_bit(page);
+        uint64_t span = BITS_PER_WORD - bit < count ? BITS_PER_WORD - bit : count;
+
+        page_bitmap[word] |= word_mask(bit, span);
+        update_summary(word);
+
+        page += span;
+        count -= span;
+    }
+}
+
+static void set_range_free(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t word = page_to_word(page);
+        uint64_t bit = page_to_bit(page);
+        uint64_t span = BITS_PER_WORD - bit < count ? BITS_PER_WORD - bit : count;
+
+        page_bitmap[word] &= ~word_mask(bit, span);
+        update_summary(word);
+
+        page += span;
+        count -= span;
+    }
+}
+
+// Returns the highest free page below `before`, or PAGE_NONE. Full bitmap
+// words are skipped 64 at a time through the summary level.
+static uint64_t find_last_free(uint64_t before) {
+    if (before == 0) {
+        return PAGE_NONE;
+    }
+
+    uint64_t page = before - 1;
+    uint64_t word = page_to_word(page);
+    uint64_t bits = ~page_bitmap[word] & word_mask(0, page_to_bit(page) + 1);
+
+    while (bits == 0) {
+        if (word == 0) {
+            return PAGE_NONE;
+        }
+        word--;
+
+        uint64_t summary = ~summary_bitmap[page_to_word(word)] & word_mask(0, page_to_bit(word) + 1);
+        while (summary == 0) {
+            if (page_to_word(word) == 0) {
+                return PAGE_NONE;
+            }
+            word = page_to_word(word) * BITS_PER_WORD - 1;
+            summary = ~summary_bitmap[page_to_word(word)];
+        }
+        word = page_to_word(word) * BITS_PER_WORD + (63 - __builtin_clzll(summary));
+        bits = ~page_bitmap[word];
+    }
+
+    return word * BITS_PER_WORD + (63 - __builtin_clzll(bits));
+}
+
+// Returns the highest allocated page below `before`, or PAGE_NONE
+static uint64_t find_last_used(uint64_t before) {
+    if (before == 0) {
+        return PAGE_NONE;
+    }
+
+    uint64_t page = before - 1;
+    uint64_t word = page_to_word(page);
+    uint64_t bits = page_bitmap[word] & word_mask(0, page_to_bit(page) + 1);
+
+    while (bits == 0) {
+        if (word == 0) {
+            return PAGE_NONE;
+        }
+        bits = page_bitmap[--word];
+    }
+
+    return word * BITS_PER_WORD + (63 - __builtin_clzll(bits));
+}
+
+// Only the first frame of a free block is linked into a free list; its
+// order tells how large the block is
+static void free_list_push(uint64_t page, uint32_t order) {
+    page_t* desc = &page_array[page];
+    uint32_t head = free_lists[order];
+
+    desc->lru_next = head;
+    desc->lru_prev = PAGE_INDEX_NONE;
+    desc->order = order;
+    desc->flags |= PAGE_FLAG_BUDDY;
+
+    if (head != PAGE_INDEX_NONE) {
+        page_array[head].lru_prev = page;
+    }
+    free_lists[order] = page;
+    free_blocks[order]++;
+}
+
+static void free_list_remove(uint64_t page, uint32_t order) {
+    page_t* desc = &page_array[page];
+
+    if (desc->lru_prev != PAGE_INDEX_NONE) {
+        page_array[desc->lru_prev].lru_next = desc->lru_next;
+    } else {
+        free_lists[order] = desc->lru_next;
+    }
+    if (desc->lru_next != PAGE_INDEX_NONE) {
+        page_array[desc->lru_next].lru_prev = desc->lru_prev;
+    }
+
+    desc->flags &= ~PAGE_FLAG_BUDDY;
+    free_blocks[order]--;
+}
+
+// Inserts a naturally aligned block, merging it with its buddy for as long
+// as the buddy is a free block of the same order.
+static void buddy_free_block(uint64_t page, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = page ^ (1ULL << order);
+        if (buddy >= max_pages) {
+            break;
+        }
+
+        page_t* desc = &page_array[buddy];
+        if (!(desc->flags & PAGE_FLAG_BUDDY) || desc->order != order) {
+            break;
+        }
+
+        free_list_remove(buddy, order);
+        page &= ~(1ULL << order);
+        order++;
+    }
+
+    free_list_push(page, order);
+}
+
+static uint32_t largest_order_for(uint64_t page, uint64_t count) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER &&
+           (page & (1ULL << order)) == 0 &&
+           (2ULL << order) <= count) {
+        order++;
+    }
+    return order;
+}
+
+// Hands [start, end) to the buddy allocator in the largest aligned blocks
+// the range allows. Blocks are carved from the top down so the lowest
+// addresses end up at the head of each free list.
+static void seed_range(uint64_t start, uint64_t end) {
+    for (uint64_t i = start; i < end; i++) {
+        page_array[i].flags = 0;
+        page_array[i].refcount = 0;
+    }
+
+    while (end > start) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (end & (1ULL << order)) == 0 &&
+               (2ULL << order) <= end - start) {
+            order++;
+        }
+        end -= 1ULL << order;
+        free_list_push(end, order);
+    }
+}
+
+static const e820_entry_t fallback_map[] = {
+    { 0x0, 0x9F000, E820_TYPE_USABLE, E820_ATTR_VALID },
+    { 0x100000, PMM_FALLBACK_MEMORY - 0x100000, E820_TYPE_USABLE, E820_ATTR_VALID },
+};
+
+static inline uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
 }
 
-static void set_page_allocated(uint64_t page) {
-    uint64_t byte = page_to_byte(page);
-    uint8_t bit = page_to_bit(page);
-    page_bitmap[byte] |= (1 << bit);
+static inline uint64_t align_down(uint64_t value, uint64_t align) {
+    return value & ~(align - 1);
 }
 
-static void set_page_free(uint64_t page) {
-    uint64_t byte = page_to_byte(page);
-    uint8_t bit = page_to_bit(page);
-    page_bitmap[byte] &= ~(1 << bit);
+static inline bool entry_valid(const e820_entry_t* entry) {
+    return entry->length != 0 && (entry->attributes & E820_ATTR_VALID);
 }
 
-void pmm_init(uint64_t total_memory) {
-    total_pages = total_memory / PAGE_SIZE;
-    uint64_t bitmap_size = (total_pages + PAGES_PER_BYTE - 1) / PAGES_PER_BYTE;
-    page_bitmap = (uint8_t*)0x140000;
+static inline bool entry_usable(const e820_entry_t* entry) {
+    return entry_valid(entry) && entry->type == E820_TYPE_USABLE;
+}
+
+static const char* entry_type_name(uint32_t type) {
+    switch (type) {
+        case E820_TYPE_USABLE:       return "usable";
+        case E820_TYPE_RESERVED:     return "reserved";
+        case E820_TYPE_ACPI_RECLAIM: return "ACPI reclaimable";
+        case E820_TYPE_ACPI_NVS:     return "ACPI NVS";
+        case E820_TYPE_BAD:          return "bad";
+        default:                     return "unknown";
+    }
+}
+
+static bool overlaps_reserved(const e820_entry_t* map, uint32_t count, uint64_t start, uint64_t end, uint64_t* skip_to) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!entry_valid(&map[i]) || entry_usable(&map[i])) {
+            continue;
+        }
+        uint64_t base = map[i].base;
+        uint64_t limit = map[i].base + map[i].length;
+        if (base < end && limit > start) {
+            *skip_to = align_up(limit, PAGE_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds `size` bytes of usable, identity-mapped memory above the fixed
+// kernel area for the bitmap and frame metadata. Returns 0 if none fits
+static uint64_t find_metadata_region(const e820_entry_t* map, uint32_t count, uint64_t size) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!entry_usable(&map[i])) {
+            continue;
+        }
+
+        uint64_t start = align_up(map[i].base, PAGE_SIZE);
+        uint64_t end = align_down(map[i].base + map[i].length, PAGE_SIZE);
+        if (start < PMM_KERNEL_END) {
+            start = PMM_KERNEL_END;
+        }
+        if (end > PMM_IDENTITY_LIMIT) {
+            end = PMM_IDENTITY_LIMIT;
+        }
+
+        uint64_t skip_to;
+        while (start + size <= end) {
+            if (!overlaps_reserved(map, count, start, start + size, &skip_to)) {
+                return start;
+            }
+            start = skip_to;
+        }
+    }
+    return 0;
+}
+
+// Clamps a byte range to whole pages inside [0, max_pages). `inward` rounds
+// towards the middle (usable memory), otherwise outwards (reserved memory)
+static bool range_to_pages(uint64_t base, uint64_t length, bool inward, uint64_t* first, uint64_t* count) {
+    uint64_t start = inward ? align_up(base, PAGE_SIZE) : align_down(base, PAGE_SIZE);
+    uint64_t end = inward ? align_down(base + length, PAGE_SIZE) : align_up(base + length, PAGE_SIZE);
+
+    start /= PAGE_SIZE;
+    end /= PAGE_SIZE;
+    if (end > max_pages) {
+        end = max_pages;
+    }
+    if (start >= end) {
+        return false;
+    }
+
+    *first = start;
+    *count = end - start;
+    return true;
+}
+
+// Walks the free runs of the bitmap from the top, optionally handing each one
+// to the buddy allocator. Returns the number of free pages
+static uint64_t scan_free_runs(bool seed) {
+    uint64_t free_pages = 0;
+    uint64_t end = max_pages;
+    uint64_t last;
+
+    while ((last = find_last_free(end)) != PAGE_NONE) {
+        uint64_t used = find_last_used(last);
+        uint64_t start = used == PAGE_NONE ? 0 : used + 1;
+
+        if (seed) {
+            seed_range(start, last + 1);
+        }
+        free_pages += last + 1 - start;
+        end = start;
+    }
+
+    return free_pages;
+}
+
+void pmm_init(const boot_info_t* boot_info) {
+    const e820_entry_t* map = fallback_map;
+    uint32_t count = sizeof(fallback_map) / sizeof(fallback_map[0]);
+
+    if (boot_info != NULL && boot_info->magic == BOOTINFO_MAGIC && boot_info->mmap_count > 0) {
+        map = (const e820_entry_t*)boot_info->mmap_addr;
+        count = boot_info->mmap_count;
+    } else {
+        serial_writestring("[PMM] No E820 map from the bootloader, assuming 64MB\n");
+    }
+    memory_map = map;
+    memory_map_count = count;
 
-    for (uint64_t i = 0; i < bitmap_size; i++) {
-        page_bitmap[i] = 0;
+    // Metadata covers every frame up to the highest usable address
+    uint64_t highest = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        serial_writestring("[PMM] E820: ");
+        serial_writehex(map[i].base);
+        serial_writestring(" - ");
+        serial_writehex(map[i].base + map[i].length);
+        serial_writestring(" ");
+        serial_writestring(entry_valid(&map[i]) ? entry_type_name(map[i].type) : "ignored");
+        serial_writestring("\n");
+
+        if (entry_usable(&map[i]) && map[i].base + map[i].length > highest) {
+            highest = map[i].base + map[i].length;
+        }
+    }
+
+    max_pages = align_down(highest, PAGE_SIZE) / PAGE_SIZE;
+    bitmap_words = (max_pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    uint64_t summary_words = (bitmap_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    // The page array follows the bitmap, cache-line aligned
+    uint64_t bitmap_size = align_up((bitmap_words + summary_words) * sizeof(uint64_t), CACHE_LINE_SIZE);
+    uint64_t metadata_size = align_up(bitmap_size + max_pages * sizeof(page_t), PAGE_SIZE);
+    uint64_t metadata = find_metadata_region(map, count, metadata_size);
+    if (metadata == 0) {
+        serial_writestring("[PMM] No room for PMM metadata below 1GB\n");
+        max_pages = 0;
+        return;
+    }
+
+    page_bitmap = (uint64_t*)metadata;
+    summary_bitmap = page_bitmap + bitmap_words;
+    page_array = (page_t*)(metadata + bitmap_size);
+
+    // Everything starts out allocated, including the padding bits past the
+    // last page, so searches never have to bounds-check them
+    for (uint64_t i = 0; i < bitmap_words; i++) {
+        page_bitmap[i] = ~0ULL;
+    }
+    for (uint64_t i = 0; i < summary_words; i++) {
+        summary_bitmap[i] = ~0ULL;
     }
 
-    uint64_t reserved_low = 0x100000 / PAGE_SIZE;
-    for (uint64_t i = 0; i < reserved_low; i++) {
-        set_page_allocated(i);
-        used_pages++;
+    // Every frame starts out reserved; seeding clears the usable ones
+    for (uint64_t i = 0; i < max_pages; i++) {
+        page_t* desc = &page_array[i];
+        desc->flags = PAGE_FLAG_RESERVED;
+        desc->type = PAGE_TYPE_NONE;
+        desc->order = 0;
+        desc->frames = 0;
+        desc->refcount = 1;
+        desc->head = i;
+        desc->lru_next = PAGE_INDEX_NONE;
+        desc->lru_prev = PAGE_INDEX_NONE;
+        desc->private = 0;
+    }
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_lists[order] = PAGE_INDEX_NONE;
+        free_blocks[order] = 0;
+        alloc_failures[order] = 0;
     }
+    fragmentation_failures = 0;
+    reclaim_hook = NULL;
+    reclaiming = false;
+    reclaims = 0;
 
-    uint64_t kernel_pages = 0x80000 / PAGE_SIZE;
-    for (uint64_t i = reserved_low; i < reserved_low + kernel_pages; i++) {
-        set_page_allocated(i);
-        used_pages++;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pcp_caches[cpu].head = 0;
+        pcp_caches[cpu].count = 0;
     }
+    zero_pool_count = 0;
 
-    uint64_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint64_t bitmap_start_page = 0x140000 / PAGE_SIZE;
-    for (uint64_t i = bitmap_start_page; i < bitmap_start_page + bitmap_pages; i++) {
-        set_page_allocated(i);
-        used_pages++;
+    // Usable entries first, then anything else on top, so overlapping or
+    // partially covered pages always end up reserved
+    uint64_t first, pages;
+    for (uint32_t i = 0; i < count; i++) {
+        if (entry_usable(&map[i]) && range_to_pages(map[i].base, map[i].length, true, &first, &pages)) {
+            set_range_free(first, pages);
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (entry_valid(&map[i]) && !entry_usable(&map[i]) &&
+            range_to_pages(map[i].base, map[i].length, false, &first, &pages)) {
+            set_range_allocated(first, pages);
+        }
     }
+    total_pages = scan_free_runs(false);
+
+    // Low memory (BIOS, boot stages, page tables, boot info) and the
+    // kernel image, then the metadata itself
+    if (range_to_pages(0, PMM_KERNEL_END, false, &first, &pages)) {
+        set_range_allocated(first, pages);
+    }
+    if (range_to_pages(metadata, metadata_size, false, &first, &pages)) {
+        set_range_allocated(first, pages);
+    }
+
+    // Seed the free lists from the bitmap, highest run first
+    used_pages = total_pages - scan_free_runs(true);
 
     serial_writestring("[PMM] Physical Memory Manager initialized\n");
 }
 
+static bool reclaim_memory(void);
+
+static uint32_t first_free_order(uint32_t order) {
+    while (order <= PMM_MAX_ORDER && free_lists[order] == PAGE_INDEX_NONE) {
+        order++;
+    }
+    return order;
+}
+
+// Takes a free block of exactly 2^order pages off the free lists, splitting
+// a larger one if needed. With may_reclaim, running out first gets one
+// reclaim pass. Returns PAGE_NONE when nothing large enough is free
+static uint64_t buddy_take_block(uint32_t order, bool may_reclaim) {
+    uint32_t current = first_free_order(order);
+    if (current > PMM_MAX_ORDER && may_reclaim && reclaim_memory()) {
+        current = first_free_order(order);
+    }
+    if (current > PMM_MAX_ORDER) {
+        alloc_failures[order]++;
+        if (pmm_get_free_pages() >= (1ULL << order)) {
+            fragmentation_failures++;
+        }
+        return PAGE_NONE;
+    }
+
+    uint64_t page = free_lists[current];
+    free_list_remove(page, current);
+
+    // Split down to the requested order, keeping the lower half each time
+    while (current > order) {
+        current--;
+        free_list_push(page + (1ULL << current), current);
+    }
+
+    return page;
+}
+
+// Returns [page, page + count) to the buddy allocator. A range that is not
+// a single aligned block (e.g. the tail of a larger allocation) is returned
+// in the largest aligned pieces it contains.
+static void release_range(uint64_t page, uint64_t count) {
+    page_t* desc = &page_array[page];
+    desc->flags &= ~PAGE_FLAG_HEAD;
+    desc->type = PAGE_TYPE_NONE;
+    desc->frames = 0;
+    desc->refcount = 0;
+    desc->private = 0;
+
+    set_range_free(page, count);
+    used_pages -= count;
+
+    while (count > 0) {
+        uint32_t piece = largest_order_for(page, count);
+        buddy_free_block(page, piece);
+        page += 1ULL << piece;
+        count -= 1ULL << piece;
+    }
+}
+
+// Fills in the descriptors of a fresh allocation: the first frame is the
+// head holding the reference count and the exact frame count, the others
+// point back at it
+static void prep_allocation(uint64_t page, uint64_t count) {
+    page_t* head = &page_array[page];
+    head->flags = count > 1 ? PAGE_FLAG_HEAD : 0;
+    head->type = PAGE_TYPE_KERNEL;
+    head->order = 0;
+    head->frames = (uint32_t)count;
+    head->refcount = 1;
+    head->head = page;
+    head->private = 0;
+
+    for (uint64_t i = 1; i < count; i++) {
+        page_t* tail = &page_array[page + i];
+        tail->flags = 0;
+        tail->type = PAGE_TYPE_KERNEL;
+        tail->refcount = 0;
+        tail->head = page;
+    }
+}
+
+static uint32_t order_for_count(uint64_t count) {
+    uint32_t order = 0;
+    while ((1ULL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+uint64_t pmm_alloc_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint64_t page = buddy_take_block(order, true);
+    if (page == PAGE_NONE) {
+        return 0;
+    }
+
+    set_range_allocated(page, 1ULL << order);
+    used_pages += 1ULL << order;
+    prep_allocation(page, 1ULL << order);
+
+    return page * PAGE_SIZE;
+}
+
+// Only the head of an allocation may free it, and only whole: anything
+// else would hand frames to the buddy lists that are free already or
+// still in use
+static bool is_allocation(uint64_t page, uint64_t count) {
+    if (count == 0 || page >= max_pages || page + count > max_pages) {
+        return false;
+    }
+    page_t* desc = &page_array[page];
+    if (!is_page_allocated(page) || (desc->flags & PAGE_FLAG_PCP)) {
+        return false;
+    }
+    return desc->head == page && desc->frames == count;
+}
+
+void pmm_free_pages(uint64_t addr, uint32_t order) {
+    uint64_t page = addr / PAGE_SIZE;
+
+    if (order > PMM_MAX_ORDER || !is_allocation(page, 1ULL << order)) {
+        return;
+    }
+    release_range(page, 1ULL << order);
+}
+
+uint64_t pmm_alloc_contiguous(uint64_t count, uint64_t align) {
+    if (count == 0 || (align & (align - 1)) != 0) {
+        return 0;
+    }
+
+    // Buddy blocks are naturally aligned, so a block of the larger of the
+    // size and alignment orders satisfies both; the unused tail goes back
+    uint32_t order = order_for_count(count);
+    uint32_t align_order = align > PAGE_SIZE ? order_for_count(align / PAGE_SIZE) : 0;
+    if (align_order > order) {
+        order = align_order;
+    }
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint64_t page = buddy_take_block(order, true);
+    if (page == PAGE_NONE) {
+        return 0;
+    }
+
+    set_range_allocated(page, 1ULL << order);
+    used_pages += 1ULL << order;
+
+    if ((1ULL << order) > count) {
+        release_range(page + count, (1ULL << order) - count);
+    }
+    prep_allocation(page, count);
+
+    return page * PAGE_SIZE;
+}
+
+void pmm_free_contiguous(uint64_t addr, uint64_t count) {
+    uint64_t page = addr / PAGE_SIZE;
+
+    if (!is_allocation(page, count)) {
+        return;
+    }
+    release_range(page, count);
+}
+
+bool pmm_shrink_contiguous(uint64_t addr, uint64_t count, uint64_t new_count) {
+    uint64_t page = addr / PAGE_SIZE;
+
+    if (new_count == 0 || new_count > count || !is_allocation(page, count)) {
+        return false;
+    }
+    if (new_count == count) {
+        return true;
+    }
+
+    page_t* head = &page_array[page];
+    head->frames = (uint32_t)new_count;
+    if (new_count == 1) {
+        head->flags &= ~PAGE_FLAG_HEAD;
+    }
+
+    // The dropped tail frames become a range of their own to release
+    uint64_t tail = page + new_count;
+    page_array[tail].head = tail;
+    release_range(tail, count - new_count);
+    return true;
+}
+
+static inline void pcp_push_hot(pmm_pcp_t* pcp, uint64_t page) {
+    pcp->head = (pcp->head - 1) & PCP_MASK;
+    pcp->frames[pcp->head] = page;
+    pcp->count++;
+}
+
+static inline void pcp_push_cold(pmm_pcp_t* pcp, uint64_t page) {
+    pcp->frames[(pcp->head + pcp->count) & PCP_MASK] = page;
+    pcp->count++;
+}
+
+static inline uint64_t pcp_pop_hot(pmm_pcp_t* pcp) {
+    uint64_t page = pcp->frames[pcp->head];
+    pcp->head = (pcp->head + 1) & PCP_MASK;
+    pcp->count--;
+    return page;
+}
+
+static inline uint64_t pcp_pop_cold(pmm_pcp_t* pcp) {
+    pcp->count--;
+    return pcp->frames[(pcp->head + pcp->count) & PCP_MASK];
+}
+
+// Moves up to PCP_BATCH frames from the buddy lists into the cache. Cached
+// frames stay marked allocated, so the shared bitmap and counters are only
+// touched once per batch
+static void pcp_refill(pmm_pcp_t* pcp) {
+    uint32_t added = 0;
+    while (added < PCP_BATCH) {
+        // Reclaim only for the first frame; a partial batch will do
+        uint64_t page = buddy_take_block(0, added == 0);
+        if (page == PAGE_NONE) {
+            break;
+        }
+        set_range_allocated(page, 1);
+        page_array[page].flags |= PAGE_FLAG_PCP;
+        pcp_push_cold(pcp, page);
+        added++;
+    }
+
+    used_pages += added;
+    pcp->refills++;
+}
+
+static void pcp_drain(pmm_pcp_t* pcp, uint32_t count) {
+    while (count-- > 0 && pcp->count > 0) {
+        uint64_t page = pcp_pop_cold(pcp);
+        page_array[page].flags &= ~PAGE_FLAG_PCP;
+        release_range(page, 1);
+    }
+    pcp->drains++;
+}
+
+// Lets the owners of cached memory give it back, then returns the per-CPU
+// frames and the zero pool to the buddy lists so the freed frames can
+// merge; both count as free already. Returns false when there is no hook,
+// or it is already running
+static bool reclaim_memory(void) {
+    if (reclaim_hook == NULL || reclaiming) {
+        return false;
+    }
+
+    reclaiming = true;
+    reclaim_hook();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (pcp_caches[cpu].count > 0) {
+            pcp_drain(&pcp_caches[cpu], pcp_caches[cpu].count);
+        }
+    }
+
+    uint64_t flags = cpu_irq_save();
+    while (zero_pool_count > 0) {
+        release_range(zero_pool[--zero_pool_count] / PAGE_SIZE, 1);
+    }
+    cpu_irq_restore(flags);
+    reclaiming = false;
+
+    reclaims++;
+    return true;
+}
+
+void pmm_set_reclaim_hook(pmm_reclaim_t hook) {
+    reclaim_hook = hook;
+}
+
+static void pcp_free(uint64_t addr, bool cold) {
+    uint64_t page = addr / PAGE_SIZE;
+
+    // Single-frame allocations only, and a frame still shared through
+    // pmm_page_get() is only dropped by pmm_page_put()
+    if (!is_allocation(page, 1) || page_array[page].refcount > 1) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_t* pcp = &pcp_caches[cpu_current_id()];
+
+    if (pcp->count == PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+
+    page_t* desc = &page_array[page];
+    desc->flags = PAGE_FLAG_PCP;
+    desc->type = PAGE_TYPE_NONE;
+    desc->refcount = 0;
+    desc->private = 0;
+    if (cold) {
+        pcp_push_cold(pcp, page);
+    } else {
+        pcp_push_hot(pcp, page);
+    }
+    pcp->frees++;
+
+    cpu_irq_restore(flags);
+}
+
 uint64_t pmm_alloc_page(void) {
-    for (uint64_t page = 0; page < total_pages; page++) {
-        if (!is_page_allocated(page)) {
-            set_page_allocated(page);
-            used_pages++;
-            return page * PAGE_SIZE;
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_t* pcp = &pcp_caches[cpu_current_id()];
+
+    if (pcp->count > 0) {
+        pcp->alloc_hits++;
+    } else {
+        pcp->alloc_misses++;
+        pcp_refill(pcp);
+        if (pcp->count == 0) {
+            cpu_irq_restore(flags);
+            return 0;
         }
     }
 
-    return 0;
+    uint64_t page = pcp_pop_hot(pcp);
+    prep_allocation(page, 1);
+
+    cpu_irq_restore(flags);
+    return page * PAGE_SIZE;
 }
 
 void pmm_free_page(uint64_t addr) {
-    uint64_t page = addr / PAGE_SIZE;
+    pcp_free(addr, false);
+}
+
+void pmm_free_page_cold(uint64_t addr) {
+    pcp_free(addr, true);
+}
+
+// Synchronous path: rep stosq
+static void zero_page(uint64_t addr) {
+    void* dest = phys_to_virt(addr);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile("rep stosq" : "+D"(dest), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Background path: non-temporal stores so zeroing a page nobody is about
+// to touch does not evict the working set. Callers fence once per batch
+static void zero_page_nontemporal(uint64_t addr) {
+    uint64_t* dest = (uint64_t*)phys_to_virt(addr);
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :: "r"(&dest[i]), "r"(0ULL) : "memory");
+    }
+}
+
+uint64_t pmm_alloc_zeroed_page(void) {
+    uint64_t flags = cpu_irq_save();
+    if (zero_pool_count > 0) {
+        uint64_t addr = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+        cpu_irq_restore(flags);
+        return addr;
+    }
+    zero_pool_misses++;
+    cpu_irq_restore(flags);
 
-    if (page >= total_pages) {
+    uint64_t addr = pmm_alloc_page();
+    if (addr != 0) {
+        zero_page(addr);
+    }
+    return addr;
+}
+
+void pmm_zero_pool_refill(void) {
+    uint32_t zeroed = 0;
+
+    while (zeroed < ZERO_POOL_BATCH && zero_pool_count < ZERO_POOL_SIZE) {
+        uint64_t addr = pmm_alloc_page();
+        if (addr == 0) {
+            break;
+        }
+        zero_page_nontemporal(addr);
+
+        uint64_t flags = cpu_irq_save();
+        zero_pool[zero_pool_count++] = addr;
+        cpu_irq_restore(flags);
+        zeroed++;
+    }
+
+    if (zeroed > 0) {
+        __asm__ volatile("sfence" ::: "memory");
+    }
+}
+
+void pmm_zero_pool_fill(void) {
+    uint32_t before;
+    do {
+        before = zero_pool_count;
+        pmm_zero_pool_refill();
+    } while (zero_pool_count != before && zero_pool_count < ZERO_POOL_SIZE);
+}
+
+void pmm_copy_page(uint64_t dest, uint64_t src) {
+    void* to = phys_to_virt(dest);
+    const void* from = phys_to_virt(src);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile("rep movsq" : "+D"(to), "+S"(from), "+c"(count) :: "memory");
+}
+
+void pmm_page_get(uint64_t addr) {
+    page_ref_inc(page_compound_head(phys_to_page(addr)));
+}
+
+void pmm_page_put(uint64_t addr) {
+    page_t* head = page_compound_head(phys_to_page(addr));
+    if (page_ref_dec(head) > 0) {
         return;
     }
 
-    if (is_page_allocated(page)) {
-        set_page_free(page);
-        used_pages--;
+    if (head->flags & PAGE_FLAG_HEAD) {
+        pmm_free_contiguous(page_to_phys(head), head->frames);
+    } else {
+        pmm_free_page(page_to_phys(head));
     }
 }
 
+// Frames parked in the per-CPU caches (and the zero pool) count as free to
+// everyone outside the PMM; the shared counters only see them at batch
+// granularity
+static uint64_t pcp_cached_pages(void) {
+    uint64_t cached = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cached += pcp_caches[cpu].count;
+    }
+    return cached;
+}
+
+void pmm_get_pcp_stats(pmm_pcp_stats_t* stats) {
+    stats->alloc_hits = 0;
+    stats->alloc_misses = 0;
+    stats->refills = 0;
+    stats->drains = 0;
+    stats->frees = 0;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pmm_pcp_t* pcp = &pcp_caches[cpu];
+        stats->alloc_hits += pcp->alloc_hits;
+        stats->alloc_misses += pcp->alloc_misses;
+        stats->refills += pcp->refills;
+        stats->drains += pcp->drains;
+        stats->frees += pcp->frees;
+    }
+    stats->cached_pages = pcp_cached_pages();
+}
+
+bool pmm_get_usable_region(uint32_t index, uint64_t* base, uint64_t* length) {
+    for (uint32_t i = 0; i < memory_map_count; i++) {
+        if (!entry_usable(&memory_map[i])) {
+            continue;
+        }
+
+        uint64_t start = align_up(memory_map[i].base, PAGE_SIZE);
+        uint64_t end = align_down(memory_map[i].base + memory_map[i].length, PAGE_SIZE);
+        if (start >= end) {
+            continue;
+        }
+        if (index-- == 0) {
+            *base = start;
+            *length = end - start;
+            return true;
+        }
+    }
+    return false;
+}
+
 uint64_t pmm_get_total_pages(void) {
     return total_pages;
 }
 
 uint64_t pmm_get_free_pages(void) {
-    return total_pages - used_pages;
+    return total_pages - used_pages + pcp_cached_pages() + zero_pool_count;
 }
 
 uint64_t pmm_get_used_pages(void) {
-    return used_pages;
+    return used_pages - pcp_cached_pages() - zero_pool_count;
+}
+
+void pmm_get_stats(pmm_stats_t* stats) {
+    stats->total_pages = total_pages;
+    stats->free_pages = pmm_get_free_pages();
+    stats->fragmentation_failures = fragmentation_failures;
+    stats->reclaims = reclaims;
+    stats->zero_pool_pages = zero_pool_count;
+    stats->zero_pool_hits = zero_pool_hits;
+    stats->zero_pool_misses = zero_pool_misses;
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        stats->free_blocks[order] = free_blocks[order];
+        stats->alloc_failures[order] = alloc_failures[order];
+    }
 }
@@ -5,16 +5,103 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "../bootinfo.h"
+
 // 4KB pages
 #define PAGE_SIZE 4096
-#define PAGES_PER_BYTE 8
 
-void pmm_init(uint64_t total_memory);
-void pmm_free_page(uint64_t addr);
+// Buddy orders 0..18, i.e. blocks from 4KB up to 1GB
+#define PMM_MAX_ORDER 18
+
+typedef struct pmm_stats {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    // Free blocks currently sitting on each buddy free list
+    uint64_t free_blocks[PMM_MAX_ORDER + 1];
+    // Failed requests per order, and how many of them failed even though
+    // enough pages were free in total (i.e. because of fragmentation)
+    uint64_t alloc_failures[PMM_MAX_ORDER + 1];
+    uint64_t fragmentation_failures;
+    // Reclaim passes run because a free list had run dry
+    uint64_t reclaims;
+    // Pre-zeroed frames ready for pmm_alloc_zeroed_page(), and how many
+    // calls were served from the pool versus zeroed on the spot
+    uint64_t zero_pool_pages;
+    uint64_t zero_pool_hits;
+    uint64_t zero_pool_misses;
+} pmm_stats_t;
+
+// Gives cached memory back to the PMM by freeing frames. Runs when an
+// allocation would fail, before it is retried once; it must not allocate
+typedef void (*pmm_reclaim_t)(void);
+
+// Per-CPU frame cache counters, summed over all CPUs
+typedef struct pmm_pcp_stats {
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t refills;
+    uint64_t drains;
+    uint64_t frees;
+    uint64_t cached_pages;
+} pmm_pcp_stats_t;
 
+void pmm_init(const boot_info_t* boot_info);
+
+// Single frames go through a per-CPU cache in front of the buddy allocator
 uint64_t pmm_alloc_page(void);
+// Ignores anything but a single-frame allocation with one reference;
+// shared frames go back through pmm_page_put()
+void pmm_free_page(uint64_t addr);
+// For frames whose contents are not cache-hot; they are reused last
+void pmm_free_page_cold(uint64_t addr);
+
+// Returns a zero-filled frame, from the pre-zeroed pool when possible
+uint64_t pmm_alloc_zeroed_page(void);
+// Tops up the pre-zeroed pool by one batch; meant to be called from the
+// idle loop
+void pmm_zero_pool_refill(void);
+// Fills the pool completely. Frames above the boot identity map can only
+// be zeroed once the direct map exists, so not before vmm_init()
+void pmm_zero_pool_fill(void);
+// Copies one frame's contents to another through the direct map
+void pmm_copy_page(uint64_t dest, uint64_t src);
+
+// Allocates 2^order physically contiguous pages, naturally aligned.
+// Returns the physical address, or 0 on failure
+uint64_t pmm_alloc_pages(uint32_t order);
+
+// order must be the one allocated with
+void pmm_free_pages(uint64_t addr, uint32_t order);
+
+// Allocates `count` physically contiguous pages starting on an `align`-byte
+// boundary (a power of two, 0 or PAGE_SIZE for none). Returns the physical
+// address, or 0 on failure
+uint64_t pmm_alloc_contiguous(uint64_t count, uint64_t align);
+
+// Like pmm_free_pages(), frees whole allocations only: addr is the first
+// frame and count the one allocated. Anything else is ignored
+void pmm_free_contiguous(uint64_t addr, uint64_t count);
+
+// Keeps the first new_count of the count frames at addr and frees the rest.
+// Returns false, changing nothing, if addr is not such an allocation
+bool pmm_shrink_contiguous(uint64_t addr, uint64_t count, uint64_t new_count);
+
+// Usable RAM from the boot memory map, page aligned. Returns false once
+// index runs past the last usable region
+bool pmm_get_usable_region(uint32_t index, uint64_t* base, uint64_t* length);
+
 uint64_t pmm_get_total_pages(void);
 uint64_t pmm_get_free_pages(void);
 uint64_t pmm_get_used_pages(void);
+// Reference counting on frames from pmm_alloc_page()/pmm_alloc_pages();
+// the frame is freed when the last reference is dropped
+void pmm_page_get(uint64_t addr);
+void pmm_page_put(uint64_t addr);
+
+// One hook; kmalloc_init() installs the allocator's
+void pmm_set_reclaim_hook(pmm_reclaim_t hook);
+
+void pmm_get_stats(pmm_stats_t* stats);
+void pmm_get_pcp_stats(pmm_pcp_stats_t* stats);
 
 #endif // __PMM_H__
@@ -0,0 +1,278 @@
+#include "slab.h"
+#include "pmm.h"
+#include "page.h"
+#include "vmm.h"
+#include "../cpu/cpu.h"
+
+// Larger slabs only when a single page would hold too few objects or
+// waste too much of itself
+#define SLAB_MAX_ORDER   3
+#define SLAB_MIN_OBJECTS 8
+
+// Objects start on the first cache line after the header
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + CACHE_LINE_SIZE - 1) & ~(uint64_t)(CACHE_LINE_SIZE - 1))
+
+static void list_add(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void list_remove(slab_t** head, slab_t* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+// The slab header sits at the start of the compound allocation holding ptr
+static slab_t* slab_of(const void* ptr) {
+    uint64_t phys = (uint64_t)ptr - vmm_direct_map_offset;
+    page_t* head = page_compound_head(phys_to_page(phys));
+    return (slab_t*)phys_to_virt(page_to_phys(head));
+}
+
+static slab_t* slab_create(slab_cache_t* cache) {
+    uint64_t phys = pmm_alloc_pages(cache->order);
+    if (phys == 0) {
+        return NULL;
+    }
+    phys_to_page(phys)->type = PAGE_TYPE_SLAB;
+
+    slab_t* slab = (slab_t*)phys_to_virt(phys);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->prev = NULL;
+    slab->next = NULL;
+
+    // Thread the freelist through the objects in address order
+    uint8_t* object = (uint8_t*)slab + cache->offset;
+    slab->freelist = object;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        if (cache->ctor != NULL) {
+            cache->ctor(object);
+        }
+        bool last = i + 1 == cache->objects_per_slab;
+        *(void**)(object + cache->link_offset) = last ? NULL : object + cache->object_size;
+        object += cache->object_size;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(slab_cache_t* cache, slab_t* slab) {
+    cache->slabs--;
+    pmm_free_pages((uint64_t)slab - vmm_direct_map_offset, cache->order);
+}
+
+// Takes one object off the slabs
+static void* shared_alloc(slab_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        cache->empty = NULL;
+        if (slab == NULL) {
+            slab = slab_create(cache);
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+        list_add(&cache->partial, slab);
+    }
+
+    uint8_t* object = slab->freelist;
+    slab->freelist = *(void**)(object + cache->link_offset);
+    slab->inuse++;
+    cache->active_objects++;
+
+    // Full slabs sit on no list until an object comes back
+    if (slab->freelist == NULL) {
+        list_remove(&cache->partial, slab);
+    }
+    return object;
+}
+
+// Puts one object back on its slab
+static void shared_free(slab_cache_t* cache, void* ptr) {
+    slab_t* slab = slab_of(ptr);
+
+    if (slab->freelist == NULL) {
+        list_add(&cache->partial, slab);
+    }
+    *(void**)((uint8_t*)ptr + cache->link_offset) = slab->freelist;
+    slab->freelist = ptr;
+    slab->inuse--;
+    cache->active_objects--;
+
+    if (slab->inuse == 0) {
+        list_remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+}
+
+static void cpu_refill(slab_cache_t* cache, slab_cpu_cache_t* cpu) {
+    while (cpu->count < SLAB_CPU_BATCH) {
+        void* object = shared_alloc(cache);
+        if (object == NULL) {
+            break;
+        }
+        cpu->objects[cpu->count++] = object;
+    }
+    cpu->refills++;
+}
+
+// Returns the count objects at the bottom of the stack, the coldest ones
+static void cpu_drain(slab_cache_t* cache, slab_cpu_cache_t* cpu, uint32_t count) {
+    if (count > cpu->count) {
+        count = cpu->count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        shared_free(cache, cpu->objects[i]);
+    }
+    for (uint32_t i = count; i < cpu->count; i++) {
+        cpu->objects[i - count] = cpu->objects[i];
+    }
+    cpu->count -= count;
+    cpu->drains++;
+}
+
+void slab_cache_init(slab_cache_t* cache, uint32_t size, uint32_t align, slab_ctor_t ctor) {
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+
+    // A constructed object keeps its contents while free, so the link
+    // goes after it
+    uint32_t link_offset = 0;
+    if (ctor != NULL) {
+        link_offset = (size + sizeof(void*) - 1) & ~(uint32_t)(sizeof(void*) - 1);
+        size = link_offset + sizeof(void*);
+    }
+    size = (size + align - 1) & ~(align - 1);
+    uint64_t offset = (SLAB_HEADER_SIZE + align - 1) & ~(uint64_t)(align - 1);
+
+    uint32_t order = 0;
+    for (; order < SLAB_MAX_ORDER; order++) {
+        uint64_t bytes = (uint64_t)PAGE_SIZE << order;
+        uint64_t count = (bytes - offset) / size;
+        uint64_t waste = bytes - offset - count * size;
+        if (count >= SLAB_MIN_OBJECTS && waste * 8 <= bytes) {
+            break;
+        }
+    }
+
+    cache->object_size = size;
+    cache->order = order;
+    cache->offset = (uint32_t)offset;
+    cache->link_offset = link_offset;
+    cache->ctor = ctor;
+    cache->objects_per_slab = (uint32_t)((((uint64_t)PAGE_SIZE << order) - offset) / size);
+    cache->partial = NULL;
+    cache->empty = NULL;
+    cache->slabs = 0;
+    cache->active_objects = 0;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        slab_cpu_cache_t* cpu = &cache->cpu[i];
+        cpu->count = 0;
+        cpu->allocs = 0;
+        cpu->frees = 0;
+        cpu->refills = 0;
+        cpu->drains = 0;
+    }
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    uint64_t flags = cpu_irq_save();
+    slab_cpu_cache_t* cpu = &cache->cpu[cpu_current_id()];
+
+    if (cpu->count == 0) {
+        cpu_refill(cache, cpu);
+        if (cpu->count == 0) {
+            cpu_irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    void* object = cpu->objects[--cpu->count];
+    cpu->allocs++;
+
+    cpu_irq_restore(flags);
+    return object;
+}
+
+void slab_free(void* ptr) {
+    slab_cache_t* cache = slab_of(ptr)->cache;
+
+    uint64_t flags = cpu_irq_save();
+    slab_cpu_cache_t* cpu = &cache->cpu[cpu_current_id()];
+
+    if (cpu->count == SLAB_CPU_HIGH) {
+        cpu_drain(cache, cpu, SLAB_CPU_BATCH);
+    }
+    cpu->objects[cpu->count++] = ptr;
+    cpu->frees++;
+
+    cpu_irq_restore(flags);
+}
+
+void slab_cache_drain(slab_cache_t* cache) {
+    uint64_t flags = cpu_irq_save();
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (cache->cpu[i].count > 0) {
+            cpu_drain(cache, &cache->cpu[i], cache->cpu[i].count);
+        }
+    }
+    if (cache->empty != NULL) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+    cpu_irq_restore(flags);
+}
+
+void slab_cache_get_stats(slab_cache_t* cache, slab_stats_t* stats) {
+    stats->cached_objects = 0;
+    stats->allocs = 0;
+    stats->frees = 0;
+    stats->refills = 0;
+    stats->drains = 0;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        slab_cpu_cache_t* cpu = &cache->cpu[i];
+        stats->cached_objects += cpu->count;
+        stats->allocs += cpu->allocs;
+        stats->frees += cpu->frees;
+        stats->refills += cpu->refills;
+        stats->drains += cpu->drains;
+    }
+
+    stats->active_objects = cache->active_objects - stats->cached_objects;
+    stats->total_objects = cache->slabs * cache->objects_per_slab;
+}
+
+slab_cache_t* slab_cache_of(const void* ptr) {
+    // Slabs are only ever reached through phys_to_virt()
+    if ((uint64_t)ptr - vmm_direct_map_offset >= DIRECT_MAP_SIZE) {
+        return NULL;
+    }
+
+    page_t* head = page_compound_head(phys_to_page((uint64_t)ptr - vmm_direct_map_offset));
+    if (head->type != PAGE_TYPE_SLAB) {
+        return NULL;
+    }
+    return slab_of(ptr)->cache;
+}
@@ -0,0 +1,83 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../cpu/cpu.h"
+
+// Per-CPU object caches refill from and drain to the slabs in batches
+#define SLAB_CPU_BATCH 16
+#define SLAB_CPU_HIGH  32
+
+// Slabs are 2^order PMM pages reached through the direct map: a slab_t
+// header, then equal-sized objects. Free objects hold the freelist link
+// in their first word, or right after the object when the cache has a
+// constructor whose work must survive a free
+typedef struct slab {
+    struct slab_cache* cache;
+    void* freelist;
+    uint32_t inuse;
+    struct slab* prev;      // on the cache's partial list
+    struct slab* next;
+} slab_t;
+
+// Runs once per object when its slab is created; freed objects must be
+// handed back in the constructed state
+typedef void (*slab_ctor_t)(void* object);
+
+// A stack of free objects owned by one CPU; the top is the most recently
+// freed and cache-warm. Only touched by its CPU with interrupts off
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) slab_cpu_cache {
+    uint32_t count;
+    void* objects[SLAB_CPU_HIGH];
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills;       // allocations that found the stack empty
+    uint64_t drains;
+} slab_cpu_cache_t;
+
+typedef struct slab_cache {
+    slab_cpu_cache_t cpu[MAX_CPUS];
+    uint32_t object_size;   // stride between objects
+    uint32_t objects_per_slab;
+    uint32_t order;
+    uint32_t offset;        // of the first object within a slab
+    uint32_t link_offset;   // of the freelist link within a free object
+    slab_ctor_t ctor;
+    slab_t* partial;        // slabs with both used and free objects
+    slab_t* empty;          // at most one, kept to absorb alloc/free churn
+    uint64_t slabs;
+    uint64_t active_objects;  // out of the slabs, per-CPU caches included
+} slab_cache_t;
+
+// Per-CPU counters summed over all CPUs
+typedef struct slab_stats {
+    uint64_t active_objects;  // held by callers
+    uint64_t cached_objects;  // parked in per-CPU caches
+    uint64_t total_objects;   // room in all slabs
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills;
+    uint64_t drains;
+} slab_stats_t;
+
+// Sets up a cache for objects of size bytes aligned to align, a power of
+// two no larger than a page. ctor may be NULL
+void slab_cache_init(slab_cache_t* cache, uint32_t size, uint32_t align, slab_ctor_t ctor);
+
+// Served from this CPU's cache, which only goes to the slabs when empty
+// or full
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(void* ptr);
+
+// Returns every per-CPU cached object to the slabs, then frees the spare
+// empty slab. Other CPUs must not be using the cache meanwhile
+void slab_cache_drain(slab_cache_t* cache);
+
+void slab_cache_get_stats(slab_cache_t* cache, slab_stats_t* stats);
+
+// The cache ptr was allocated from, or NULL if it is not a slab object
+slab_cache_t* slab_cache_of(const void* ptr);
+
+#endif // __SLAB_H__
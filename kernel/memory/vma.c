@@ -0,0 +1,251 @@
+#include "vma.h"
+#include "pmm.h"
+#include "page.h"
+#include "kmem_cache.h"
+#include "../cpu/cpu.h"
+#include "../cpu/idt.h"
+#include "../drivers/serial.h"
+
+static vma_fault_stats_t fault_stats;
+static kmem_cache_t* vma_cache = NULL;
+
+static inline vmm_space_t* space_for(vmm_space_t* space, uint64_t addr) {
+    return vmm_is_kernel_address(addr) ? vmm_get_kernel_space() : space;
+}
+
+static void release_anon(uint64_t phys, uint64_t size) {
+    (void)size;
+    pmm_page_put(phys);
+}
+
+static uint64_t area_backing(vm_area_t* area, uint64_t addr) {
+    if (area->type != VMA_ANON) {
+        return area->fault(area, addr - area->start);
+    }
+
+    uint64_t phys = pmm_alloc_zeroed_page();
+    if (phys != 0) {
+        phys_to_page(phys)->type = PAGE_TYPE_ANON;
+    }
+    return phys;
+}
+
+static bool map_one(vm_area_t* area, uint64_t addr) {
+    uint64_t phys = area_backing(area, addr);
+    if (phys == 0) {
+        return false;
+    }
+
+    if (!vmm_map_page(addr, phys, area->flags)) {
+        if (area->type == VMA_ANON) {
+            pmm_page_put(phys);
+        }
+        return false;
+    }
+
+    fault_stats.pages_mapped++;
+    return true;
+}
+
+// Maps the faulting page, then whatever is still unmapped in the aligned
+// fault-around window around it. Only the first has to succeed
+static bool fault_in(vm_area_t* area, uint64_t page) {
+    if (!map_one(area, page)) {
+        return false;
+    }
+
+    uint64_t window = (uint64_t)area->fault_around * PAGE_SIZE;
+    uint64_t first = page & ~(window - 1);
+    uint64_t last = first + window;
+    if (first < area->start) {
+        first = area->start;
+    }
+    if (last > area->end) {
+        last = area->end;
+    }
+
+    for (uint64_t addr = first; addr < last; addr += PAGE_SIZE) {
+        if (addr == page || vmm_is_mapped(addr)) {
+            continue;
+        }
+        if (!map_one(area, addr)) {
+            break;
+        }
+        fault_stats.around_pages++;
+    }
+
+    return true;
+}
+
+static void page_fault_handler(interrupt_frame_t* frame) {
+    if (!vma_handle_fault(cpu_read_cr2(), frame->error_code)) {
+        idt_fatal("Unresolved page fault", frame);
+    }
+}
+
+void vma_init(void) {
+    fault_stats.minor_faults = 0;
+    fault_stats.failed_faults = 0;
+    fault_stats.pages_mapped = 0;
+    fault_stats.around_pages = 0;
+    fault_stats.cow_faults = 0;
+    fault_stats.total_cycles = 0;
+    fault_stats.max_cycles = 0;
+
+    vma_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    if (vma_cache == NULL) {
+        serial_writestring("[VMA] Failed to create the vm_area cache\n");
+    }
+
+    idt_set_handler(VECTOR_PAGE_FAULT, page_fault_handler);
+    serial_writestring("[VMA] Page fault handler installed\n");
+}
+
+vm_area_t* vma_map(vmm_space_t* space, uint64_t start, uint64_t len, uint64_t flags,
+                   vma_fault_t fault, void* private) {
+    if (len == 0 || ((start | len) & (PAGE_SIZE - 1)) || start + len < start) {
+        return NULL;
+    }
+    space = space_for(space, start);
+
+    // Sorted insert, refusing overlaps
+    vm_area_t** link = vmm_space_areas(space);
+    while (*link != NULL && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->start < start + len) {
+        return NULL;
+    }
+
+    vm_area_t* area = vma_cache != NULL ? (vm_area_t*)kmem_cache_alloc(vma_cache) : NULL;
+    if (area == NULL) {
+        return NULL;
+    }
+
+    area->start = start;
+    area->end = start + len;
+    area->flags = flags;
+    area->type = fault == NULL ? VMA_ANON : VMA_FILE;
+    area->fault_around = 1;
+    area->fault = fault;
+    area->private = private;
+    area->next = *link;
+    *link = area;
+
+    return area;
+}
+
+vm_area_t* vma_map_anon(vmm_space_t* space, uint64_t start, uint64_t len, uint64_t flags) {
+    return vma_map(space, start, len, flags, NULL, NULL);
+}
+
+void vma_remove(vmm_space_t* space, vm_area_t* area) {
+    space = space_for(space, area->start);
+
+    vm_area_t** link = vmm_space_areas(space);
+    while (*link != NULL && *link != area) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    *link = area->next;
+
+    vmm_space_unmap_range(space, area->start, area->end - area->start,
+                          area->type == VMA_ANON ? release_anon : NULL);
+    kmem_cache_free(vma_cache, area);
+}
+
+void vma_remove_all(vmm_space_t* space) {
+    vm_area_t** head = vmm_space_areas(space);
+    while (*head != NULL) {
+        vma_remove(space, *head);
+    }
+}
+
+bool vma_clone_all(vmm_space_t* dst, vmm_space_t* src) {
+    for (vm_area_t* area = *vmm_space_areas(src); area != NULL; area = area->next) {
+        // Kernel-half areas are already visible in every space
+        if (vmm_is_kernel_address(area->start)) {
+            continue;
+        }
+
+        uint64_t len = area->end - area->start;
+        vm_area_t* copy = vma_map(dst, area->start, len, area->flags, area->fault, area->private);
+        if (copy == NULL) {
+            return false;
+        }
+        copy->fault_around = area->fault_around;
+
+        if (!vmm_space_copy_range(dst, src, area->start, len, area->type == VMA_ANON)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vm_area_t* vma_find(vmm_space_t* space, uint64_t addr) {
+    space = space_for(space, addr);
+
+    for (vm_area_t* area = *vmm_space_areas(space); area != NULL; area = area->next) {
+        if (addr < area->start) {
+            break;
+        }
+        if (addr < area->end) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+void vma_set_fault_around(vm_area_t* area, uint32_t pages) {
+    uint32_t around = 1;
+    while (around * 2 <= pages && around * 2 <= VMA_FAULT_AROUND_MAX) {
+        around *= 2;
+    }
+    area->fault_around = around;
+}
+
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    uint64_t start = cpu_rdtsc();
+
+    vm_area_t* area = vma_find(vmm_get_current_space(), addr);
+    bool resolved = false;
+
+    // Missing pages are mapped in and writes to shared pages copied; any
+    // other protection fault or a reserved-bit fault is a real error
+    if (area != NULL && !(error_code & PF_RSVD) &&
+        (!(error_code & PF_WRITE) || (area->flags & PT_WRITABLE))) {
+        if (!(error_code & PF_PRESENT)) {
+            resolved = fault_in(area, addr & ~(uint64_t)(PAGE_SIZE - 1));
+        } else if (error_code & PF_WRITE) {
+            resolved = vmm_break_cow(addr);
+            if (resolved) {
+                fault_stats.cow_faults++;
+            }
+        }
+    }
+
+    uint64_t cycles = cpu_rdtsc() - start;
+    if (resolved) {
+        fault_stats.minor_faults++;
+        fault_stats.total_cycles += cycles;
+        if (cycles > fault_stats.max_cycles) {
+            fault_stats.max_cycles = cycles;
+        }
+    } else {
+        fault_stats.failed_faults++;
+    }
+
+    return resolved;
+}
+
+void vma_get_fault_stats(vma_fault_stats_t* stats) {
+    stats->minor_faults = fault_stats.minor_faults;
+    stats->failed_faults = fault_stats.failed_faults;
+    stats->pages_mapped = fault_stats.pages_mapped;
+    stats->around_pages = fault_stats.around_pages;
+    stats->cow_faults = fault_stats.cow_faults;
+    stats->total_cycles = fault_stats.total_cycles;
+    stats->max_cycles = fault_stats.max_cycles;
+}
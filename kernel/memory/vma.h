@@ -0,0 +1,81 @@
+#ifndef __VMA_H__
+#define __VMA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vmm.h"
+
+// vm_area_t.type
+#define VMA_ANON 0  // zero-filled frames on first touch
+#define VMA_FILE 1  // frames supplied by the area's fault callback
+
+// Upper bound for vm_area_t.fault_around, in pages
+#define VMA_FAULT_AROUND_MAX 16
+
+// #PF error code bits
+#define PF_PRESENT (1 << 0)  // protection violation rather than a missing page
+#define PF_WRITE   (1 << 1)
+#define PF_USER    (1 << 2)
+#define PF_RSVD    (1 << 3)
+#define PF_FETCH   (1 << 4)
+
+typedef struct vm_area vm_area_t;
+
+// Returns the frame backing the page `offset` bytes into the area, or 0
+typedef uint64_t (*vma_fault_t)(vm_area_t* area, uint64_t offset);
+
+struct vm_area {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;         // PT_* flags for the pages mapped in
+    uint32_t type;
+    uint32_t fault_around;  // pages mapped per fault, a power of two
+    vma_fault_t fault;      // VMA_FILE only
+    void* private;
+    vm_area_t* next;        // sorted by start
+};
+
+typedef struct vma_fault_stats {
+    uint64_t minor_faults;  // resolved without I/O
+    uint64_t failed_faults; // outside every area, bad access or no memory
+    uint64_t pages_mapped;  // including fault-around pages
+    uint64_t around_pages;
+    uint64_t cow_faults;    // writes to pages shared by a clone
+    uint64_t total_cycles;  // time spent resolving faults
+    uint64_t max_cycles;
+} vma_fault_stats_t;
+
+// Installs the page fault handler
+void vma_init(void);
+
+// Registers a demand-paged area of [start, start + len) in the space;
+// kernel-half areas always go to the kernel space. Nothing is mapped
+// until touched. Returns NULL on overlap, misalignment or no memory
+vm_area_t* vma_map_anon(vmm_space_t* space, uint64_t start, uint64_t len, uint64_t flags);
+vm_area_t* vma_map(vmm_space_t* space, uint64_t start, uint64_t len, uint64_t flags,
+                   vma_fault_t fault, void* private);
+
+// Unmaps the area, frees the frames of anonymous ones and forgets it
+void vma_remove(vmm_space_t* space, vm_area_t* area);
+void vma_remove_all(vmm_space_t* space);
+
+// Registers a copy of every user area of src in dst and shares their
+// present pages: copy-on-write for anonymous areas, as is for file-backed
+// ones. Returns false when out of memory, leaving dst partly filled
+bool vma_clone_all(vmm_space_t* dst, vmm_space_t* src);
+
+vm_area_t* vma_find(vmm_space_t* space, uint64_t addr);
+
+// Pages mapped per fault, rounded down to a power of two and capped at
+// VMA_FAULT_AROUND_MAX; 1 maps only the faulting page
+void vma_set_fault_around(vm_area_t* area, uint32_t pages);
+
+// Resolves a fault at addr in the current space: maps missing pages and
+// copies shared ones on write. Returns false when no area covers it or
+// the access is not allowed
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
+
+void vma_get_fault_stats(vma_fault_stats_t* stats);
+
+#endif // __VMA_H__
@@ -0,0 +1,385 @@
+#include "vmalloc.h"
+#include "vmm.h"
+#include "vma.h"
+#include "pmm.h"
+#include "page.h"
+#include "kmem_cache.h"
+#include "../drivers/serial.h"
+#include <stdbool.h>
+
+// Each area is followed by one unmapped page, so running off the end
+// faults instead of landing in the next area
+#define GUARD_SIZE PAGE_SIZE
+
+// Frames lazily freed areas may hold before a purge is forced
+#define LAZY_PAGES_MAX 8192
+
+// vmap_area_t.link index
+#define TREE_ADDR 0
+#define TREE_SIZE 1
+
+typedef struct vmap_area vmap_area_t;
+
+// AVL links for one tree
+typedef struct vmap_link {
+    vmap_area_t* left;
+    vmap_area_t* right;
+    int32_t height;
+} vmap_link_t;
+
+// A range of the window. Free ranges sit in both free trees; used ones
+// only in the used tree, keyed by address
+struct vmap_area {
+    uint64_t start;
+    uint64_t size;          // bytes, guard page included
+    vmap_link_t link[2];
+    uint32_t frames;        // frames faulted in, chained through page_t.lru_next
+    uint32_t frame_count;
+};
+
+static vmap_area_t* free_by_addr = NULL;
+static vmap_area_t* free_by_size = NULL;
+static vmap_area_t* used_by_addr = NULL;
+
+static vmap_area_t* lazy_areas[VMALLOC_LAZY_MAX];
+static uint32_t lazy_count = 0;
+static uint64_t lazy_pages = 0;
+
+static vmalloc_stats_t stats;
+static kmem_cache_t* vmap_cache = NULL;
+
+// Free ranges order by size first, so the tree answers best fit; the
+// address breaks ties and keeps keys unique
+static inline bool area_less(int tree, const vmap_area_t* a, const vmap_area_t* b) {
+    if (tree == TREE_SIZE && a->size != b->size) {
+        return a->size < b->size;
+    }
+    return a->start < b->start;
+}
+
+static inline int32_t height(int tree, const vmap_area_t* node) {
+    return node != NULL ? node->link[tree].height : 0;
+}
+
+static void update_height(int tree, vmap_area_t* node) {
+    int32_t left = height(tree, node->link[tree].left);
+    int32_t right = height(tree, node->link[tree].right);
+    node->link[tree].height = 1 + (left > right ? left : right);
+}
+
+static vmap_area_t* rotate_right(int tree, vmap_area_t* node) {
+    vmap_area_t* left = node->link[tree].left;
+    node->link[tree].left = left->link[tree].right;
+    left->link[tree].right = node;
+    update_height(tree, node);
+    update_height(tree, left);
+    return left;
+}
+
+static vmap_area_t* rotate_left(int tree, vmap_area_t* node) {
+    vmap_area_t* right = node->link[tree].right;
+    node->link[tree].right = right->link[tree].left;
+    right->link[tree].left = node;
+    update_height(tree, node);
+    update_height(tree, right);
+    return right;
+}
+
+static vmap_area_t* rebalance(int tree, vmap_area_t* node) {
+    vmap_link_t* link = &node->link[tree];
+    update_height(tree, node);
+
+    int32_t balance = height(tree, link->left) - height(tree, link->right);
+    if (balance > 1) {
+        vmap_link_t* child = &link->left->link[tree];
+        if (height(tree, child->left) < height(tree, child->right)) {
+            link->left = rotate_left(tree, link->left);
+        }
+        return rotate_right(tree, node);
+    }
+    if (balance < -1) {
+        vmap_link_t* child = &link->right->link[tree];
+        if (height(tree, child->right) < height(tree, child->left)) {
+            link->right = rotate_right(tree, link->right);
+        }
+        return rotate_left(tree, node);
+    }
+    return node;
+}
+
+// The tree helpers return the new root of the subtree they were given
+static vmap_area_t* tree_insert(int tree, vmap_area_t* root, vmap_area_t* node) {
+    if (root == NULL) {
+        node->link[tree].left = NULL;
+        node->link[tree].right = NULL;
+        node->link[tree].height = 1;
+        return node;
+    }
+
+    if (area_less(tree, node, root)) {
+        root->link[tree].left = tree_insert(tree, root->link[tree].left, node);
+    } else {
+        root->link[tree].right = tree_insert(tree, root->link[tree].right, node);
+    }
+    return rebalance(tree, root);
+}
+
+static vmap_area_t* tree_remove_min(int tree, vmap_area_t* root, vmap_area_t** min) {
+    if (root->link[tree].left == NULL) {
+        *min = root;
+        return root->link[tree].right;
+    }
+    root->link[tree].left = tree_remove_min(tree, root->link[tree].left, min);
+    return rebalance(tree, root);
+}
+
+static vmap_area_t* tree_remove(int tree, vmap_area_t* root, vmap_area_t* node) {
+    if (root == NULL) {
+        return NULL;
+    }
+
+    if (root == node) {
+        vmap_area_t* left = node->link[tree].left;
+        vmap_area_t* right = node->link[tree].right;
+        if (right == NULL) {
+            return left;
+        }
+
+        vmap_area_t* min;
+        right = tree_remove_min(tree, right, &min);
+        min->link[tree].left = left;
+        min->link[tree].right = right;
+        return rebalance(tree, min);
+    }
+
+    if (area_less(tree, node, root)) {
+        root->link[tree].left = tree_remove(tree, root->link[tree].left, node);
+    } else {
+        root->link[tree].right = tree_remove(tree, root->link[tree].right, node);
+    }
+    return rebalance(tree, root);
+}
+
+// The area with the highest start not above addr, or NULL
+static vmap_area_t* tree_floor(vmap_area_t* root, uint64_t addr) {
+    vmap_area_t* found = NULL;
+    while (root != NULL) {
+        if (root->start <= addr) {
+            found = root;
+            root = root->link[TREE_ADDR].right;
+        } else {
+            root = root->link[TREE_ADDR].left;
+        }
+    }
+    return found;
+}
+
+// The smallest free range that fits size, lowest address among equals
+static vmap_area_t* best_fit(uint64_t size) {
+    vmap_area_t* found = NULL;
+    vmap_area_t* node = free_by_size;
+    while (node != NULL) {
+        if (node->size >= size) {
+            found = node;
+            node = node->link[TREE_SIZE].left;
+        } else {
+            node = node->link[TREE_SIZE].right;
+        }
+    }
+    return found;
+}
+
+static void free_insert(vmap_area_t* area) {
+    free_by_addr = tree_insert(TREE_ADDR, free_by_addr, area);
+    free_by_size = tree_insert(TREE_SIZE, free_by_size, area);
+    stats.free_ranges++;
+}
+
+static void free_remove(vmap_area_t* area) {
+    free_by_addr = tree_remove(TREE_ADDR, free_by_addr, area);
+    free_by_size = tree_remove(TREE_SIZE, free_by_size, area);
+    stats.free_ranges--;
+}
+
+// Returns the range to the free trees, merged with free neighbours
+static void free_range(vmap_area_t* area) {
+    vmap_area_t* prev = area->start > 0 ? tree_floor(free_by_addr, area->start - 1) : NULL;
+    if (prev != NULL && prev->start + prev->size == area->start) {
+        free_remove(prev);
+        area->start = prev->start;
+        area->size += prev->size;
+        kmem_cache_free(vmap_cache, prev);
+    }
+
+    vmap_area_t* next = tree_floor(free_by_addr, area->start + area->size);
+    if (next != NULL && next->start == area->start + area->size) {
+        free_remove(next);
+        area->size += next->size;
+        kmem_cache_free(vmap_cache, next);
+    }
+
+    free_insert(area);
+}
+
+// Fault callback for the window: backs pages of live areas only, so guard
+// pages, holes and freed areas fault for good
+static uint64_t vmalloc_fault(vm_area_t* window, uint64_t offset) {
+    uint64_t addr = window->start + offset;
+    vmap_area_t* area = tree_floor(used_by_addr, addr);
+    if (area == NULL || addr >= area->start + area->size - GUARD_SIZE) {
+        return 0;
+    }
+
+    uint64_t phys = pmm_alloc_zeroed_page();
+    if (phys == 0) {
+        return 0;
+    }
+
+    page_t* page = phys_to_page(phys);
+    page->type = PAGE_TYPE_KERNEL;
+    page->lru_next = area->frames;
+    area->frames = (uint32_t)page_to_index(page);
+    area->frame_count++;
+    stats.mapped_pages++;
+    return phys;
+}
+
+void vmalloc_init(void) {
+    free_by_addr = NULL;
+    free_by_size = NULL;
+    used_by_addr = NULL;
+    lazy_count = 0;
+    lazy_pages = 0;
+
+    stats.used_areas = 0;
+    stats.used_bytes = 0;
+    stats.mapped_pages = 0;
+    stats.free_ranges = 0;
+    stats.lazy_areas = 0;
+    stats.purges = 0;
+
+    vmap_cache = kmem_cache_create("vmap_area", sizeof(vmap_area_t), 0, NULL);
+    vmap_area_t* all = vmap_cache != NULL ? (vmap_area_t*)kmem_cache_alloc(vmap_cache) : NULL;
+    if (all == NULL || vma_map(vmm_get_kernel_space(), VMALLOC_BASE, VMALLOC_SIZE, PT_WRITABLE,
+                               vmalloc_fault, NULL) == NULL) {
+        if (all != NULL) {
+            kmem_cache_free(vmap_cache, all);
+        }
+        serial_writestring("[VMALLOC] Failed to register the vmalloc window\n");
+        return;
+    }
+
+    all->start = VMALLOC_BASE;
+    all->size = VMALLOC_SIZE;
+    free_insert(all);
+
+    serial_writestring("[VMALLOC] Window at ");
+    serial_writehex(VMALLOC_BASE);
+    serial_writestring("\n");
+}
+
+void* vmalloc(size_t size) {
+    if (size == 0 || size > VMALLOC_SIZE - GUARD_SIZE) {
+        return NULL;
+    }
+    uint64_t need = ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)) + GUARD_SIZE;
+
+    vmap_area_t* area = best_fit(need);
+    if (area == NULL && lazy_count > 0) {
+        vmalloc_purge();
+        area = best_fit(need);
+    }
+    if (area == NULL) {
+        return NULL;
+    }
+
+    vmap_area_t* rest = NULL;
+    if (area->size > need) {
+        rest = (vmap_area_t*)kmem_cache_alloc(vmap_cache);
+        if (rest == NULL) {
+            return NULL;
+        }
+    }
+
+    free_remove(area);
+    if (rest != NULL) {
+        rest->start = area->start + need;
+        rest->size = area->size - need;
+        free_insert(rest);
+        area->size = need;
+    }
+
+    area->frames = PAGE_INDEX_NONE;
+    area->frame_count = 0;
+    used_by_addr = tree_insert(TREE_ADDR, used_by_addr, area);
+
+    stats.used_areas++;
+    stats.used_bytes += need - GUARD_SIZE;
+    return (void*)area->start;
+}
+
+void vfree(void* addr) {
+    if (addr == NULL) {
+        return;
+    }
+
+    vmap_area_t* area = tree_floor(used_by_addr, (uint64_t)addr);
+    if (area == NULL || area->start != (uint64_t)addr) {
+        serial_writestring("[VMALLOC] vfree() of an address vmalloc() did not return\n");
+        return;
+    }
+
+    used_by_addr = tree_remove(TREE_ADDR, used_by_addr, area);
+    stats.used_areas--;
+    stats.used_bytes -= area->size - GUARD_SIZE;
+
+    lazy_areas[lazy_count++] = area;
+    lazy_pages += area->frame_count;
+    stats.lazy_areas = lazy_count;
+
+    if (lazy_count == VMALLOC_LAZY_MAX || lazy_pages >= LAZY_PAGES_MAX) {
+        vmalloc_purge();
+    }
+}
+
+void vmalloc_purge(void) {
+    if (lazy_count == 0) {
+        return;
+    }
+
+    vmm_range_t ranges[VMALLOC_LAZY_MAX];
+    for (uint32_t i = 0; i < lazy_count; i++) {
+        ranges[i].start = lazy_areas[i]->start;
+        ranges[i].len = lazy_areas[i]->size - GUARD_SIZE;
+    }
+
+    // The frames are tracked here rather than handed back by the unmap,
+    // which keeps every area behind a single flush
+    vmm_space_unmap_ranges(vmm_get_kernel_space(), ranges, lazy_count, NULL);
+
+    for (uint32_t i = 0; i < lazy_count; i++) {
+        vmap_area_t* area = lazy_areas[i];
+        uint32_t index = area->frames;
+        while (index != PAGE_INDEX_NONE) {
+            page_t* page = &page_array[index];
+            index = page->lru_next;
+            pmm_free_page(page_to_phys(page));
+        }
+        stats.mapped_pages -= area->frame_count;
+        free_range(area);
+    }
+
+    lazy_count = 0;
+    lazy_pages = 0;
+    stats.lazy_areas = 0;
+    stats.purges++;
+}
+
+void vmalloc_get_stats(vmalloc_stats_t* out) {
+    out->used_areas = stats.used_areas;
+    out->used_bytes = stats.used_bytes;
+    out->mapped_pages = stats.mapped_pages;
+    out->free_ranges = stats.free_ranges;
+    out->lazy_areas = stats.lazy_areas;
+    out->purges = stats.purges;
+}
@@ -0,0 +1,43 @@
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel virtual address window handed out by vmalloc(), right above the
+// direct map
+#define VMALLOC_BASE 0xFFFFC00000000000ULL
+#define VMALLOC_SIZE 0x0000200000000000ULL   // 32 TB
+
+// Freed areas are unmapped in batches of this many, under one TLB flush
+#define VMALLOC_LAZY_MAX 32
+
+typedef struct vmalloc_stats {
+    uint64_t used_areas;
+    uint64_t used_bytes;    // address space handed out, guard pages excluded
+    uint64_t mapped_pages;  // frames faulted in, lazily freed areas included
+    uint64_t free_ranges;   // holes in the window
+    uint64_t lazy_areas;    // freed but not yet unmapped
+    uint64_t purges;
+} vmalloc_stats_t;
+
+// Registers the window with the page fault handler; needs vma_init()
+void vmalloc_init(void);
+
+// Reserves size bytes of virtually contiguous kernel memory, rounded up
+// to whole pages and followed by an unmapped guard page. Frames are
+// zero-filled on first touch. Returns NULL when out of address space or
+// memory for the bookkeeping
+void* vmalloc(size_t size);
+
+// The area stays mapped until the next purge; its address space and
+// frames are reused only after that
+void vfree(void* addr);
+
+// Unmaps every lazily freed area now and returns its frames and address
+// space
+void vmalloc_purge(void);
+
+void vmalloc_get_stats(vmalloc_stats_t* stats);
+
+#endif // __VMALLOC_H__
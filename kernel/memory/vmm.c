@@ -1,15 +1,91 @@
 #include "vmm.h"
 #include "pmm.h"
+#include "page.h"
+#include "kmem_cache.h"
+#include "vma.h"
+#include "../cpu/cpu.h"
 #include "../drivers/serial.h"
 
-#define PML4_INDEX(addr) (((addr) >> 39) & 0x1FF)
-#define PDPT_INDEX(addr) (((addr) >> 30) & 0x1FF)
-#define PD_INDEX(addr)   (((addr) >> 21) & 0x1FF)
-#define PT_INDEX(addr)   (((addr) >> 12) & 0x1FF)
+// Paging levels, counted up from the leaf table
+#define LEVEL_PT   1
+#define LEVEL_PD   2
+#define LEVEL_PDPT 3
+#define LEVEL_PML4 4
+
+#define LEVEL_SHIFT(level)        (12 + 9 * ((level) - 1))
+#define LEVEL_SIZE(level)         (1ULL << LEVEL_SHIFT(level))
+#define LEVEL_INDEX(addr, level)  (((addr) >> LEVEL_SHIFT(level)) & 0x1FF)
 
 #define PT_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
-static pte_t* pml4 = NULL;
+#define CR0_WP    (1ULL << 16)
+#define CR4_PGE   (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+#define CR3_PCID_MASK 0xFFFULL
+#define CR3_NOFLUSH   (1ULL << 63)  // keep the new PCID's TLB entries
+#define PCID_COUNT    4096
+
+// The PAT bit moves from bit 7 in a 4 KB PTE to bit 12 in a huge entry
+#define PT_PAT_4K   (1ULL << 7)
+#define PT_PAT_HUGE (1ULL << 12)
+
+// Past this many pages a range operation reloads CR3 instead of issuing
+// one invlpg per page
+#define TLB_FLUSH_CEILING 32
+
+// Invalidations collected while a range operation edits one space's tables
+// and issued once at the end. Frames unmapped with a release callback and
+// emptied tables are held here until the flush, so nothing is reused while
+// still in a TLB or paging-structure cache
+typedef struct tlb_batch {
+    vmm_space_t* space;
+    uint64_t addrs[TLB_FLUSH_CEILING];
+    uint32_t count;
+    bool flush_all;
+    bool global;        // kernel-half addresses are in the batch
+    vmm_release_t release;
+    uint64_t pending_phys[TLB_FLUSH_CEILING];
+    uint64_t pending_size[TLB_FLUSH_CEILING];
+    uint32_t pending_count;
+    uint64_t pending_tables[TLB_FLUSH_CEILING];
+    uint32_t table_count;
+} tlb_batch_t;
+
+// Remembers the table that held the last entry a range operation touched,
+// so neighbouring pages under the same table skip the walk from the PML4
+typedef struct walk_cursor {
+    pte_t* table;
+    int level;
+    uint64_t base;      // first address the table covers
+} walk_cursor_t;
+
+struct vmm_space {
+    uint64_t pml4_phys;
+    pte_t* pml4;
+    uint16_t pcid;          // 0 when none was free; such spaces always flush
+    bool tlb_stale;         // the PCID may hold stale entries
+    struct vm_area* areas;  // demand-paged regions, see vma.c
+    struct vmm_space* next;
+};
+
+uint64_t vmm_direct_map_offset = 0;
+
+// The boot tables, which every other space shares the kernel half of
+static vmm_space_t kernel_space;
+static vmm_space_t* current_space = &kernel_space;
+static vmm_space_t* space_list = NULL;
+// Created with the first space, as vmm_init() runs before the allocators
+static kmem_cache_t* space_cache = NULL;
+
+static uint64_t pcid_bitmap[PCID_COUNT / 64];
+static bool gb_pages = false;
+static bool global_pages = false;
+static bool pcid_supported = false;
+static bool pcid_enabled = false;
+
+static uint64_t page_table_pages = 0;
+static uint64_t tables_reclaimed = 0;
 
 static inline uint64_t get_cr3(void) {
     uint64_t cr3;
@@ -21,121 +97,951 @@ static inline void set_cr3(uint64_t cr3) {
     __asm__ volatile("mov %0, %%cr3" :: "r"(cr3));
 }
 
-static pte_t* alloc_page_table(void) {
-    uint64_t phys = pmm_alloc_page();
+static inline uint64_t get_cr0(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void set_cr0(uint64_t cr0) {
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+static inline uint64_t get_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void set_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static inline void invlpg(uint64_t virt) {
+    __asm__ volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+// Drops the current PCID's non-global entries
+static inline void flush_tlb_local(void) {
+    set_cr3(get_cr3());
+}
+
+// Drops everything, global entries and other PCIDs included
+static inline void flush_tlb_all(void) {
+    if (global_pages) {
+        uint64_t cr4 = get_cr4();
+        set_cr4(cr4 & ~CR4_PGE);
+        set_cr4(cr4);
+    } else {
+        flush_tlb_local();
+    }
+}
+
+// PML4 slot 0 still holds the kernel image, so it belongs to the kernel
+// half along with the upper 256 slots
+static inline bool kernel_half(uint64_t virt) {
+    uint64_t index = LEVEL_INDEX(virt, LEVEL_PML4);
+    return index == 0 || index >= 256;
+}
+
+static inline void tlb_batch_init(tlb_batch_t* batch, vmm_space_t* space) {
+    batch->space = space;
+    batch->count = 0;
+    batch->flush_all = false;
+    batch->global = false;
+    batch->release = NULL;
+    batch->pending_count = 0;
+    batch->table_count = 0;
+}
+
+static void tlb_batch_add(tlb_batch_t* batch, uint64_t virt) {
+    if (kernel_half(virt)) {
+        batch->global = true;
+    }
+    if (batch->flush_all) {
+        return;
+    }
+    if (batch->count == TLB_FLUSH_CEILING) {
+        batch->flush_all = true;
+        return;
+    }
+    batch->addrs[batch->count++] = virt;
+}
+
+static void free_page_table(uint64_t phys);
+
+static void tlb_batch_flush(tlb_batch_t* batch) {
+    bool queued = batch->flush_all || batch->count > 0;
+
+    if (queued && batch->space != current_space) {
+        // The user half of a space that is not loaded has nothing in the
+        // TLB under the current PCID; its own PCID is flushed on next load
+        batch->space->tlb_stale = true;
+        queued = batch->global;
+    }
+
+    if (queued && batch->flush_all) {
+        if (batch->global) {
+            flush_tlb_all();
+        } else {
+            flush_tlb_local();
+        }
+    } else if (queued) {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            invlpg(batch->addrs[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < batch->pending_count; i++) {
+        batch->release(batch->pending_phys[i], batch->pending_size[i]);
+    }
+    for (uint32_t i = 0; i < batch->table_count; i++) {
+        free_page_table(batch->pending_tables[i]);
+    }
+
+    vmm_release_t release = batch->release;
+    tlb_batch_init(batch, batch->space);
+    batch->release = release;
+}
+
+// Frame address held by a leaf entry at the given level
+static inline uint64_t frame_mask(int level) {
+    return PT_ADDR_MASK & ~(LEVEL_SIZE(level) - 1);
+}
+
+// The table a non-leaf entry points to
+static inline pte_t* entry_table(pte_t entry) {
+    return (pte_t*)phys_to_virt(entry & PT_ADDR_MASK);
+}
+
+// Returns the physical address of a zeroed table, or 0
+static uint64_t alloc_page_table(void) {
+    uint64_t phys = pmm_alloc_zeroed_page();
     if (phys == 0) {
+        return 0;
+    }
+
+    page_t* page = phys_to_page(phys);
+    page->type = PAGE_TYPE_PAGETABLE;
+    page->private = 0;
+    page_table_pages++;
+    return phys;
+}
+
+// Only frames the VMM allocated go back; the boot tables Stage2 built are
+// left where they are
+static void free_page_table(uint64_t phys) {
+    if (phys_to_page(phys)->type == PAGE_TYPE_PAGETABLE) {
+        page_table_pages--;
+        pmm_free_page(phys);
+    }
+}
+
+// Tables the VMM allocated below the PML4 count their present entries in
+// page_t.private, so a range unmap can tell when one has emptied. Boot
+// tables and PML4s are never reclaimed and are not counted
+static inline page_t* counted_table(pte_t* entry, int level) {
+    if (level == LEVEL_PML4) {
         return NULL;
     }
+    page_t* page = phys_to_page(virt_to_phys(entry) & PT_ADDR_MASK);
+    return page->type == PAGE_TYPE_PAGETABLE ? page : NULL;
+}
 
-    pte_t* table = (pte_t*)phys;
-    for (int i = 0; i < 512; i++) {
-        table[i] = 0;
+// For an entry at the given level that just became present
+static inline void table_entry_added(pte_t* entry, int level) {
+    page_t* table = counted_table(entry, level);
+    if (table != NULL) {
+        table->private++;
     }
+}
+
+// For an entry that was just cleared. Returns true when its table is empty
+static inline bool table_entry_removed(pte_t* entry, int level) {
+    page_t* table = counted_table(entry, level);
+    return table != NULL && --table->private == 0;
+}
 
-    return table;
+// Frees a table at the given level and every table below it
+static void free_table_tree(uint64_t phys, int level) {
+    if (level > LEVEL_PT) {
+        pte_t* table = (pte_t*)phys_to_virt(phys);
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PT_PRESENT) && !(table[i] & PT_HUGE)) {
+                free_table_tree(table[i] & PT_ADDR_MASK, level - 1);
+            }
+        }
+    }
+    free_page_table(phys);
 }
 
-static pte_t* get_or_create_table(pte_t* parent, uint64_t index, uint64_t flags) {
+static pte_t* get_or_create_table(pte_t* parent, int level, uint64_t index, uint64_t flags) {
     if (parent[index] & PT_PRESENT) {
-        return (pte_t*)(parent[index] & PT_ADDR_MASK);
+        return entry_table(parent[index]);
     }
 
-    pte_t* table = alloc_page_table();
-    if (table == NULL) {
+    uint64_t table = alloc_page_table();
+    if (table == 0) {
         return NULL;
     }
 
-    parent[index] = ((uint64_t)table) | flags | PT_PRESENT;
-    return table;
+    parent[index] = table | flags | PT_PRESENT;
+    table_entry_added(&parent[index], level);
+    return entry_table(parent[index]);
+}
+
+// Replaces a huge entry at the given level with a table of 512 entries one
+// level down that map the same memory with the same attributes
+static bool split_huge_entry(pte_t* entry, int level, uint64_t virt, tlb_batch_t* batch) {
+    uint64_t table_phys = alloc_page_table();
+    if (table_phys == 0) {
+        return false;
+    }
+
+    pte_t* table = (pte_t*)phys_to_virt(table_phys);
+    uint64_t old = *entry;
+    uint64_t phys = old & frame_mask(level);
+    uint64_t child_size = LEVEL_SIZE(level - 1);
+    uint64_t child_flags = old & ~PT_ADDR_MASK;
+
+    if (level - 1 == LEVEL_PT) {
+        child_flags &= ~PT_HUGE;
+        if (old & PT_PAT_HUGE) {
+            child_flags |= PT_PAT_4K;
+        }
+    } else {
+        child_flags |= old & PT_PAT_HUGE;
+    }
+
+    for (int i = 0; i < 512; i++) {
+        table[i] = (phys + i * child_size) | child_flags;
+    }
+    phys_to_page(table_phys)->private = 512;
+
+    *entry = table_phys | (old & (PT_WRITABLE | PT_USER)) | PT_PRESENT;
+
+    // The translation is unchanged, so dropping the old TLB entry can wait
+    // for the batch; one invlpg anywhere in the huge page is enough
+    tlb_batch_add(batch, virt);
+    return true;
+}
+
+// Every space points at the same kernel-half PDPTs, so a new kernel PML4
+// entry has to be copied into all of them
+static void sync_kernel_entry(uint64_t index) {
+    for (vmm_space_t* space = space_list; space != NULL; space = space->next) {
+        space->pml4[index] = kernel_space.pml4[index];
+    }
+}
+
+// Walks down to the entry that maps virt at the given level in the batch's
+// space, creating missing tables and splitting huge pages above that level
+// on the way
+static pte_t* walk_create(uint64_t virt, int level, uint64_t flags, tlb_batch_t* batch) {
+    bool kernel = kernel_half(virt);
+    pte_t* table = kernel ? kernel_space.pml4 : batch->space->pml4;
+
+    for (int cur = LEVEL_PML4; cur > level; cur--) {
+        uint64_t index = LEVEL_INDEX(virt, cur);
+        pte_t* entry = &table[index];
+        bool created = !(*entry & PT_PRESENT);
+
+        if ((*entry & PT_PRESENT) && (*entry & PT_HUGE)) {
+            if (!split_huge_entry(entry, cur, virt, batch)) {
+                return NULL;
+            }
+        }
+
+        table = get_or_create_table(table, cur, index, PT_WRITABLE | (flags & PT_USER));
+        if (table == NULL) {
+            return NULL;
+        }
+        if (created && kernel && cur == LEVEL_PML4) {
+            sync_kernel_entry(index);
+        }
+    }
+
+    return &table[LEVEL_INDEX(virt, level)];
+}
+
+// Walks towards virt without changing anything. Returns the entry the walk
+// stopped at, either a leaf of any size or the first non-present entry,
+// and stores its level
+static pte_t* walk_lookup(vmm_space_t* space, uint64_t virt, int* level) {
+    pte_t* table = space->pml4;
+
+    for (int cur = LEVEL_PML4; ; cur--) {
+        pte_t* entry = &table[LEVEL_INDEX(virt, cur)];
+        if (cur == LEVEL_PT || !(*entry & PT_PRESENT) || (*entry & PT_HUGE)) {
+            *level = cur;
+            return entry;
+        }
+        table = entry_table(*entry);
+    }
+}
+
+// Same as walk_create, but reuses the cursor's table while virt stays
+// inside it
+static pte_t* cursor_walk_create(walk_cursor_t* cursor, uint64_t virt, int level,
+                                 uint64_t flags, tlb_batch_t* batch) {
+    uint64_t base = virt & ~(LEVEL_SIZE(level + 1) - 1);
+
+    if (cursor->table == NULL || cursor->level != level || cursor->base != base) {
+        pte_t* entry = walk_create(virt, level, flags, batch);
+        if (entry == NULL) {
+            return NULL;
+        }
+        cursor->table = entry - LEVEL_INDEX(virt, level);
+        cursor->level = level;
+        cursor->base = base;
+    }
+
+    return &cursor->table[LEVEL_INDEX(virt, level)];
+}
+
+// Same as walk_lookup, but reuses the cursor's leaf table while virt stays
+// inside it
+static pte_t* cursor_walk_lookup(walk_cursor_t* cursor, vmm_space_t* space, uint64_t virt, int* level) {
+    uint64_t base = virt & ~(LEVEL_SIZE(LEVEL_PD) - 1);
+
+    if (cursor->table != NULL && cursor->level == LEVEL_PT && cursor->base == base) {
+        *level = LEVEL_PT;
+        return &cursor->table[LEVEL_INDEX(virt, LEVEL_PT)];
+    }
+
+    pte_t* entry = walk_lookup(space, virt, level);
+    if (*level == LEVEL_PT) {
+        cursor->table = entry - LEVEL_INDEX(virt, LEVEL_PT);
+        cursor->level = LEVEL_PT;
+        cursor->base = base;
+    }
+    return entry;
+}
+
+static bool map_at_level(walk_cursor_t* cursor, uint64_t virt, uint64_t phys, int level,
+                         uint64_t flags, tlb_batch_t* batch) {
+    pte_t* entry = cursor_walk_create(cursor, virt, level, flags, batch);
+    if (entry == NULL) {
+        return false;
+    }
+
+    if (kernel_half(virt)) {
+        flags |= PT_GLOBAL;
+    }
+
+    uint64_t old = *entry;
+    if (level == LEVEL_PT) {
+        *entry = (phys & PT_ADDR_MASK) | flags | PT_PRESENT;
+    } else {
+        *entry = (phys & frame_mask(level)) | flags | PT_HUGE | PT_PRESENT;
+    }
+
+    if (!(old & PT_PRESENT)) {
+        // Not-present entries are never cached, so there is nothing to drop
+        table_entry_added(entry, level);
+        return true;
+    }
+
+    if (level > LEVEL_PT && !(old & PT_HUGE)) {
+        // A whole table of smaller mappings was replaced. Any of them may
+        // still be cached, and the walker must not see the tables once
+        // they are freed, so flush now rather than at the end
+        batch->flush_all = true;
+        batch->global |= kernel_half(virt);
+        tlb_batch_flush(batch);
+        free_table_tree(old & PT_ADDR_MASK, level - 1);
+    } else {
+        tlb_batch_add(batch, virt);
+    }
+
+    return true;
+}
+
+// Maps every usable RAM region at DIRECT_MAP_BASE. Runs on the boot
+// identity map, so the tables it allocates must come from the first 1 GB;
+// that holds because the buddy lists hand out the lowest frames first
+static bool build_direct_map(void) {
+    uint64_t base, length;
+
+    for (uint32_t i = 0; pmm_get_usable_region(i, &base, &length); i++) {
+        if (base + length > DIRECT_MAP_SIZE) {
+            serial_writestring("[VMM] RAM above the direct map limit ignored\n");
+            if (base >= DIRECT_MAP_SIZE) {
+                continue;
+            }
+            length = DIRECT_MAP_SIZE - base;
+        }
+        if (!vmm_map_range(DIRECT_MAP_BASE + base, base, length, PT_WRITABLE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sets the global bit on every leaf below a kernel-half table
+static void mark_global(pte_t* table, int level) {
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PT_PRESENT)) {
+            continue;
+        }
+        if (level == LEVEL_PT || (table[i] & PT_HUGE)) {
+            table[i] |= PT_GLOBAL;
+        } else {
+            mark_global(entry_table(table[i]), level - 1);
+        }
+    }
+}
+
+static uint16_t pcid_alloc(void) {
+    for (uint32_t word = 0; word < PCID_COUNT / 64; word++) {
+        if (pcid_bitmap[word] != ~0ULL) {
+            uint32_t bit = __builtin_ctzll(~pcid_bitmap[word]);
+            pcid_bitmap[word] |= 1ULL << bit;
+            return (uint16_t)(word * 64 + bit);
+        }
+    }
+    return 0;
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (pcid != 0) {
+        pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    }
 }
 
 void vmm_init(void) {
+    // Without WP the kernel writes straight through read-only entries, so
+    // a PT_COW page would never fault and its shared frame would be
+    // written in place. Every kernel mapping is writable; only COW entries
+    // are not
+    set_cr0(get_cr0() | CR0_WP);
+
     uint64_t cr3 = get_cr3();
-    pml4 = (pte_t*)cr3;
+    kernel_space.pml4_phys = cr3 & PT_ADDR_MASK;
+    kernel_space.pml4 = (pte_t*)phys_to_virt(kernel_space.pml4_phys);
+    kernel_space.pcid = 0;
+    kernel_space.tlb_stale = false;
+    kernel_space.areas = NULL;
+    kernel_space.next = NULL;
+    current_space = &kernel_space;
+    space_list = NULL;
+    space_cache = NULL;
+    page_table_pages = 0;
+    tables_reclaimed = 0;
+
+    // PCID 0 belongs to the kernel space
+    for (uint32_t i = 0; i < PCID_COUNT / 64; i++) {
+        pcid_bitmap[i] = 0;
+    }
+    pcid_bitmap[0] = 1;
+
+    gb_pages = cpu_has_1gb_pages();
+    global_pages = cpu_has_global_pages();
+    // Without global pages a PCID switch would keep nothing of the kernel
+    // half, and flush_tlb_all() could not reach the other PCIDs
+    pcid_supported = global_pages && cpu_has_pcid();
+
+    if (gb_pages) {
+        serial_writestring("[VMM] 1 GB pages supported\n");
+    }
+
+    if (global_pages) {
+        if (kernel_space.pml4[0] & PT_PRESENT) {
+            mark_global(entry_table(kernel_space.pml4[0]), LEVEL_PDPT);
+        }
+        set_cr4(get_cr4() | CR4_PGE);
+        serial_writestring("[VMM] Global kernel pages enabled\n");
+    }
+
+    if (build_direct_map()) {
+        vmm_direct_map_offset = DIRECT_MAP_BASE;
+        kernel_space.pml4 = (pte_t*)phys_to_virt(kernel_space.pml4_phys);
+        serial_writestring("[VMM] Direct map at ");
+        serial_writehex(DIRECT_MAP_BASE);
+        serial_writestring("\n");
+    } else {
+        serial_writestring("[VMM] Out of memory building the direct map, staying on the identity map\n");
+    }
+
+    if (vmm_set_pcid(true)) {
+        serial_writestring("[VMM] PCID enabled\n");
+    }
 
     serial_writestring("[VMM] Virtual Memory Manager initialized\n");
 }
 
+vmm_space_t* vmm_create_space(void) {
+    if (space_cache == NULL) {
+        space_cache = kmem_cache_create("vmm_space", sizeof(vmm_space_t), 0, NULL);
+        if (space_cache == NULL) {
+            return NULL;
+        }
+    }
+
+    vmm_space_t* space = (vmm_space_t*)kmem_cache_alloc(space_cache);
+    if (space == NULL) {
+        return NULL;
+    }
+
+    uint64_t phys = alloc_page_table();
+    if (phys == 0) {
+        kmem_cache_free(space_cache, space);
+        return NULL;
+    }
+
+    space->pml4_phys = phys;
+    space->pml4 = (pte_t*)phys_to_virt(phys);
+
+    // The kernel half by reference: same PDPTs as the kernel space
+    space->pml4[0] = kernel_space.pml4[0];
+    for (int i = 256; i < 512; i++) {
+        space->pml4[i] = kernel_space.pml4[i];
+    }
+
+    // A recycled PCID can still tag the previous owner's entries
+    space->pcid = pcid_alloc();
+    space->tlb_stale = true;
+    space->areas = NULL;
+
+    space->next = space_list;
+    space_list = space;
+    return space;
+}
+
+void vmm_destroy_space(vmm_space_t* space) {
+    if (space == NULL || space == &kernel_space) {
+        return;
+    }
+    if (space == current_space) {
+        vmm_switch(&kernel_space);
+    }
+
+    // Returns the frames behind the space's regions
+    vma_remove_all(space);
+
+    vmm_space_t** link = &space_list;
+    while (*link != NULL && *link != space) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = space->next;
+    }
+
+    for (int i = 1; i < 256; i++) {
+        if (space->pml4[i] & PT_PRESENT) {
+            free_table_tree(space->pml4[i] & PT_ADDR_MASK, LEVEL_PDPT);
+        }
+    }
+    free_page_table(space->pml4_phys);
+    pcid_free(space->pcid);
+    kmem_cache_free(space_cache, space);
+}
+
+vmm_space_t* vmm_clone_space(vmm_space_t* src) {
+    vmm_space_t* space = vmm_create_space();
+    if (space == NULL) {
+        return NULL;
+    }
+
+    // A half-built clone is torn down like any other space, which drops
+    // the references taken so far
+    if (!vma_clone_all(space, src)) {
+        vmm_destroy_space(space);
+        return NULL;
+    }
+    return space;
+}
+
+void vmm_switch(vmm_space_t* space) {
+    if (space == current_space) {
+        return;
+    }
+
+    uint64_t cr3 = space->pml4_phys;
+    if (pcid_enabled) {
+        cr3 |= space->pcid;
+        if (space->pcid != 0 && !space->tlb_stale) {
+            cr3 |= CR3_NOFLUSH;
+        }
+    }
+    space->tlb_stale = false;
+    current_space = space;
+
+    set_cr3(cr3);
+}
+
+vmm_space_t* vmm_get_current_space(void) {
+    return current_space;
+}
+
+vmm_space_t* vmm_get_kernel_space(void) {
+    return &kernel_space;
+}
+
+struct vm_area** vmm_space_areas(vmm_space_t* space) {
+    return &space->areas;
+}
+
+bool vmm_is_kernel_address(uint64_t virt) {
+    return kernel_half(virt);
+}
+
+bool vmm_set_pcid(bool enable) {
+    if (enable && !pcid_supported) {
+        return false;
+    }
+    if (enable == pcid_enabled) {
+        return true;
+    }
+
+    // CR4.PCIDE can only be set while CR3 holds PCID 0
+    vmm_space_t* space = current_space;
+    vmm_switch(&kernel_space);
+
+    uint64_t cr4 = get_cr4();
+    set_cr4(enable ? (cr4 | CR4_PCIDE) : (cr4 & ~CR4_PCIDE));
+    pcid_enabled = enable;
+
+    // Entries made while PCIDs were off are all tagged PCID 0
+    for (vmm_space_t* other = space_list; other != NULL; other = other->next) {
+        other->tlb_stale = true;
+    }
+
+    vmm_switch(space);
+    return true;
+}
+
 bool vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
-    uint64_t pml4_idx = PML4_INDEX(virt);
-    uint64_t pdpt_idx = PDPT_INDEX(virt);
-    uint64_t pd_idx = PD_INDEX(virt);
-    uint64_t pt_idx = PT_INDEX(virt);
+    walk_cursor_t cursor = { NULL, 0, 0 };
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, current_space);
 
-    pte_t* pdpt = get_or_create_table(pml4, pml4_idx, PT_WRITABLE);
-    if (pdpt == NULL) return false;
+    bool mapped = map_at_level(&cursor, virt, phys, LEVEL_PT, flags, &batch);
+    tlb_batch_flush(&batch);
+    return mapped;
+}
 
-    pte_t* pd = get_or_create_table(pdpt, pdpt_idx, PT_WRITABLE);
-    if (pd == NULL) {
+bool vmm_map_huge_page(uint64_t virt, uint64_t phys, uint64_t page_size, uint64_t flags) {
+    int level;
+    if (page_size == PAGE_SIZE_2M) {
+        level = LEVEL_PD;
+    } else if (page_size == PAGE_SIZE_1G && gb_pages) {
+        level = LEVEL_PDPT;
+    } else {
         return false;
     }
-    pte_t* pt = get_or_create_table(pd, pd_idx, PT_WRITABLE);
-    if (pt == NULL) {
+
+    if ((virt | phys) & (page_size - 1)) {
         return false;
     }
-    pt[pt_idx] = (phys & PT_ADDR_MASK) | flags | PT_PRESENT;
 
-    __asm__ volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    walk_cursor_t cursor = { NULL, 0, 0 };
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, current_space);
+
+    bool mapped = map_at_level(&cursor, virt, phys, level, flags, &batch);
+    tlb_batch_flush(&batch);
+    return mapped;
+}
+
+bool vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags) {
+    if ((virt | phys) & (PAGE_SIZE_4K - 1)) {
+        return false;
+    }
+    len = (len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+
+    walk_cursor_t cursor = { NULL, 0, 0 };
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, current_space);
+
+    uint64_t offset = 0;
+    while (offset < len) {
+        uint64_t v = virt + offset;
+        uint64_t p = phys + offset;
+        uint64_t left = len - offset;
 
+        int level = LEVEL_PT;
+        for (int try = gb_pages ? LEVEL_PDPT : LEVEL_PD; try > LEVEL_PT; try--) {
+            uint64_t size = LEVEL_SIZE(try);
+            if (((v | p) & (size - 1)) == 0 && left >= size) {
+                level = try;
+                break;
+            }
+        }
+
+        if (!map_at_level(&cursor, v, p, level, flags, &batch)) {
+            tlb_batch_flush(&batch);
+            vmm_unmap_range(virt, offset);
+            return false;
+        }
+        offset += LEVEL_SIZE(level);
+    }
+
+    tlb_batch_flush(&batch);
     return true;
 }
 
 void vmm_unmap_page(uint64_t virt) {
-    uint64_t pml4_idx = PML4_INDEX(virt);
-    uint64_t pdpt_idx = PDPT_INDEX(virt);
-    uint64_t pd_idx = PD_INDEX(virt);
-    uint64_t pt_idx = PT_INDEX(virt);
+    vmm_unmap_range(virt, PAGE_SIZE_4K);
+}
+
+void vmm_unmap_range(uint64_t virt, uint64_t len) {
+    vmm_space_unmap_range(current_space, virt, len, NULL);
+}
+
+// Unlinks the tables below `table` that no longer hold any entry for
+// [start, end) and hands them to the batch, to be freed after the flush.
+// Kernel-half PDPTs stay, as every space's PML4 points at them
+static void prune_tables(pte_t* table, int level, uint64_t start, uint64_t end, tlb_batch_t* batch) {
+    uint64_t size = LEVEL_SIZE(level);
+
+    for (uint64_t virt = start; virt < end; ) {
+        uint64_t next = (virt & ~(size - 1)) + size;
+        if (next > end || next < virt) {
+            next = end;
+        }
 
-    if (!(pml4[pml4_idx] & PT_PRESENT)) { 
-        return; 
+        pte_t* entry = &table[LEVEL_INDEX(virt, level)];
+        if (!(*entry & PT_PRESENT) || (*entry & PT_HUGE)) {
+            virt = next;
+            continue;
+        }
+
+        uint64_t child = *entry & PT_ADDR_MASK;
+        if (level - 1 > LEVEL_PT) {
+            prune_tables(entry_table(*entry), level - 1, virt, next, batch);
+        }
+
+        page_t* page = phys_to_page(child);
+        if (page->type == PAGE_TYPE_PAGETABLE && page->private == 0 &&
+            !(level == LEVEL_PML4 && kernel_half(virt))) {
+            if (batch->table_count == TLB_FLUSH_CEILING) {
+                tlb_batch_flush(batch);
+            }
+            *entry = 0;
+            table_entry_removed(entry, level);
+            batch->pending_tables[batch->table_count++] = child;
+            tables_reclaimed++;
+
+            if (kernel_half(virt)) {
+                // Paging-structure caches are per PCID and invlpg only
+                // reaches the current one; other spaces may still cache
+                // the way through this shared table
+                batch->flush_all = true;
+                batch->global = true;
+            } else {
+                tlb_batch_add(batch, virt);
+            }
+        }
+        virt = next;
     }
-    pte_t* pdpt = (pte_t*)(pml4[pml4_idx] & PT_ADDR_MASK);
+}
 
-    if (!(pdpt[pdpt_idx] & PT_PRESENT)) {
-        return;
+// Clears one range into the batch, without flushing
+static void unmap_into_batch(vmm_space_t* space, uint64_t virt, uint64_t len, tlb_batch_t* batch) {
+    uint64_t end = (virt + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    virt &= ~(PAGE_SIZE_4K - 1);
+    uint64_t start = virt;
+    bool emptied = false;
+
+    walk_cursor_t cursor = { NULL, 0, 0 };
+
+    while (virt < end) {
+        int level;
+        pte_t* entry = cursor_walk_lookup(&cursor, space, virt, &level);
+        uint64_t size = LEVEL_SIZE(level);
+        uint64_t next = (virt & ~(size - 1)) + size;
+
+        if (!(*entry & PT_PRESENT)) {
+            // Nothing mapped anywhere under this entry
+            virt = next;
+            continue;
+        }
+
+        if (level > LEVEL_PT && ((virt & (size - 1)) != 0 || next > end)) {
+            // Only part of the huge page goes away; split it and retry
+            if (!split_huge_entry(entry, level, virt, batch)) {
+                serial_writestring("[VMM] Out of memory splitting a huge page\n");
+                break;
+            }
+            continue;
+        }
+
+        if (batch->release != NULL) {
+            if (batch->pending_count == TLB_FLUSH_CEILING) {
+                tlb_batch_flush(batch);
+            }
+            batch->pending_phys[batch->pending_count] = *entry & frame_mask(level);
+            batch->pending_size[batch->pending_count] = size;
+            batch->pending_count++;
+        }
+
+        *entry = 0;
+        emptied |= table_entry_removed(entry, level);
+        tlb_batch_add(batch, virt);
+        virt = next;
     }
-    pte_t* pd = (pte_t*)(pdpt[pdpt_idx] & PT_ADDR_MASK);
 
-    if (!(pd[pd_idx] & PT_PRESENT)) {
-        return;
+    if (emptied) {
+        prune_tables(space->pml4, LEVEL_PML4, start, end, batch);
     }
-    pte_t* pt = (pte_t*)(pd[pd_idx] & PT_ADDR_MASK);
+}
 
-    pt[pt_idx] = 0;
+void vmm_space_unmap_range(vmm_space_t* space, uint64_t virt, uint64_t len, vmm_release_t release) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+    batch.release = release;
 
-    __asm__ volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    unmap_into_batch(space, virt, len, &batch);
+    tlb_batch_flush(&batch);
 }
 
-uint64_t vmm_get_physical(uint64_t virt) {
-    uint64_t pml4_idx = PML4_INDEX(virt);
-    uint64_t pdpt_idx = PDPT_INDEX(virt);
-    uint64_t pd_idx = PD_INDEX(virt);
-    uint64_t pt_idx = PT_INDEX(virt);
+void vmm_space_unmap_ranges(vmm_space_t* space, const vmm_range_t* ranges, uint32_t count,
+                            vmm_release_t release) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+    batch.release = release;
 
-    if (!(pml4[pml4_idx] & PT_PRESENT)) {
-        return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        unmap_into_batch(space, ranges[i].start, ranges[i].len, &batch);
+    }
+    tlb_batch_flush(&batch);
+}
+
+bool vmm_space_copy_range(vmm_space_t* dst, vmm_space_t* src, uint64_t virt, uint64_t len, bool cow) {
+    uint64_t end = (virt + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    virt &= ~(PAGE_SIZE_4K - 1);
+
+    walk_cursor_t src_cursor = { NULL, 0, 0 };
+    walk_cursor_t dst_cursor = { NULL, 0, 0 };
+    tlb_batch_t src_batch;
+    tlb_batch_t dst_batch;
+    tlb_batch_init(&src_batch, src);
+    tlb_batch_init(&dst_batch, dst);
+    bool copied = true;
+
+    while (virt < end) {
+        int level;
+        pte_t* entry = cursor_walk_lookup(&src_cursor, src, virt, &level);
+        uint64_t size = LEVEL_SIZE(level);
+        uint64_t next = (virt & ~(size - 1)) + size;
+
+        if (!(*entry & PT_PRESENT)) {
+            virt = next;
+            continue;
+        }
+
+        if (level > LEVEL_PT) {
+            // Frames are referenced one 4 KB page at a time
+            if (!split_huge_entry(entry, level, virt, &src_batch)) {
+                copied = false;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t phys = *entry & PT_ADDR_MASK;
+        if (cow) {
+            if (*entry & PT_WRITABLE) {
+                *entry = (*entry & ~PT_WRITABLE) | PT_COW;
+                tlb_batch_add(&src_batch, virt);
+            }
+            pmm_page_get(phys);
+        }
+
+        if (!map_at_level(&dst_cursor, virt, phys, LEVEL_PT, *entry & ~(PT_ADDR_MASK | PT_PRESENT), &dst_batch)) {
+            if (cow) {
+                pmm_page_put(phys);
+            }
+            copied = false;
+            break;
+        }
+        virt = next;
     }
-    pte_t* pdpt = (pte_t*)(pml4[pml4_idx] & PT_ADDR_MASK);
 
-    if (!(pdpt[pdpt_idx] & PT_PRESENT)) {
-        return 0;
+    tlb_batch_flush(&src_batch);
+    tlb_batch_flush(&dst_batch);
+    return copied;
+}
+
+bool vmm_break_cow(uint64_t virt) {
+    int level;
+    pte_t* entry = walk_lookup(current_space, virt, &level);
+    if (level != LEVEL_PT || (*entry & (PT_PRESENT | PT_COW)) != (PT_PRESENT | PT_COW)) {
+        return false;
+    }
+
+    uint64_t old = *entry & PT_ADDR_MASK;
+    uint64_t flags = (*entry & ~(PT_ADDR_MASK | PT_COW)) | PT_WRITABLE;
+    page_t* page = page_compound_head(phys_to_page(old));
+
+    if (page->refcount == 1) {
+        // Every other sharer has already copied or gone away
+        *entry = old | flags;
+        invlpg(virt);
+        return true;
+    }
+
+    uint64_t copy = pmm_alloc_page();
+    if (copy == 0) {
+        return false;
     }
-    pte_t* pd = (pte_t*)(pdpt[pdpt_idx] & PT_ADDR_MASK);
+    pmm_copy_page(copy, old);
+    phys_to_page(copy)->type = page->type;
 
-    if (!(pd[pd_idx] & PT_PRESENT)) {
+    *entry = copy | flags;
+    invlpg(virt);
+    pmm_page_put(old);
+    return true;
+}
+
+bool vmm_split_huge_page(uint64_t virt) {
+    int level;
+    pte_t* entry = walk_lookup(current_space, virt, &level);
+    if (!(*entry & PT_PRESENT) || level == LEVEL_PT) {
+        return false;
+    }
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, current_space);
+
+    bool split = split_huge_entry(entry, level, virt, &batch);
+    tlb_batch_flush(&batch);
+    return split;
+}
+
+uint64_t vmm_get_page_size(uint64_t virt) {
+    int level;
+    pte_t* entry = walk_lookup(current_space, virt, &level);
+    if (!(*entry & PT_PRESENT)) {
         return 0;
     }
-    pte_t* pt = (pte_t*)(pd[pd_idx] & PT_ADDR_MASK);
 
-    if (!(pt[pt_idx] & PT_PRESENT)) {
+    return LEVEL_SIZE(level);
+}
+
+uint64_t vmm_get_physical(uint64_t virt) {
+    return vmm_space_get_physical(current_space, virt);
+}
+
+uint64_t vmm_space_get_physical(vmm_space_t* space, uint64_t virt) {
+    int level;
+    pte_t* entry = walk_lookup(space, virt, &level);
+    if (!(*entry & PT_PRESENT)) {
         return 0;
     }
 
-    uint64_t phys_base = pt[pt_idx] & PT_ADDR_MASK;
-    uint64_t offset = virt & 0xFFF;
+    uint64_t phys_base = *entry & frame_mask(level);
+    uint64_t offset = virt & (LEVEL_SIZE(level) - 1);
     return phys_base + offset;
 }
 
 bool vmm_is_mapped(uint64_t virt) {
     return vmm_get_physical(virt) != 0;
 }
+
+void vmm_get_stats(vmm_stats_t* stats) {
+    stats->page_table_pages = page_table_pages;
+    stats->tables_reclaimed = tables_reclaimed;
+}
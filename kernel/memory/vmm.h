@@ -10,21 +10,143 @@
 #define PT_USER       (1 << 2)
 #define PT_WRITETHROUGH (1 << 3)
 #define PT_CACHE_DISABLE (1 << 4)
+#define PT_HUGE       (1 << 7)  // PS: PD/PDPT entry maps a 2 MB/1 GB page
+#define PT_GLOBAL     (1 << 8)  // set on every kernel-half mapping
+#define PT_COW        (1 << 9)  // available bit: read-only until a write copies it
+
+#define PAGE_SIZE_4K 0x1000ULL
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+// All usable RAM is mapped at this offset once vmm_init() has run
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL
+#define DIRECT_MAP_SIZE 0x0000400000000000ULL   // 64 TB
+
+// Per-space mappings live in PML4 slots 1-255; slot 0 still holds the
+// identity-mapped kernel image and is shared like the upper half
+#define USER_SPACE_BASE 0x0000008000000000ULL
+#define USER_SPACE_END  0x0000800000000000ULL
 
 typedef uint64_t pte_t;
 
+typedef struct vmm_space vmm_space_t;
+struct vm_area;
+
+// Called for each frame a range unmap takes out, after the TLB flush
+typedef void (*vmm_release_t)(uint64_t phys, uint64_t size);
+
+typedef struct vmm_range {
+    uint64_t start;
+    uint64_t len;
+} vmm_range_t;
+
+typedef struct vmm_stats {
+    // Frames holding page tables the VMM allocated; the boot tables are
+    // not included
+    uint64_t page_table_pages;
+    // Tables freed because an unmap left them empty
+    uint64_t tables_reclaimed;
+} vmm_stats_t;
+
+// Offset phys_to_virt() adds: 0 while only the boot identity map of the
+// first 1 GB exists, DIRECT_MAP_BASE after vmm_init()
+extern uint64_t vmm_direct_map_offset;
+
+static inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + vmm_direct_map_offset);
+}
+
+// Valid for direct-map addresses and the identity-mapped kernel image;
+// anything else has to go through vmm_get_physical()
+static inline uint64_t virt_to_phys(const void* virt) {
+    uint64_t addr = (uint64_t)virt;
+    if (addr >= DIRECT_MAP_BASE && addr < DIRECT_MAP_BASE + DIRECT_MAP_SIZE) {
+        return addr - DIRECT_MAP_BASE;
+    }
+    return addr;
+}
+
 void vmm_init(void);
 
 // Returns: true on success, false on failure
+// A huge page covering virt is split first
 bool vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
 
-// virtual address to unmap
+// Maps one 2 MB or 1 GB page; virt and phys must be aligned to page_size
+// Returns: false on bad alignment, unsupported size or no memory
+bool vmm_map_huge_page(uint64_t virt, uint64_t phys, uint64_t page_size, uint64_t flags);
+
+// Maps len bytes using the largest page size the alignment of virt and
+// phys allows at each step. Nothing is left mapped on failure
+bool vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
+
+// virtual address to unmap; a huge page covering it is split first
 void vmm_unmap_page(uint64_t virt);
 
+// Unmaps [virt, virt + len); huge pages only partly inside are split.
+// Page tables left empty are freed
+void vmm_unmap_range(uint64_t virt, uint64_t len);
+
+// Splits the huge page covering virt one level down (1 GB into 2 MB
+// pages, 2 MB into 4 KB pages). Returns false if virt is not mapped by a
+// huge page or no memory is available
+bool vmm_split_huge_page(uint64_t virt);
+
+// returns the size of the page mapping virt, or 0 if not mapped
+uint64_t vmm_get_page_size(uint64_t virt);
+
 // returns the physical address, or 0 if not mapped
 uint64_t vmm_get_physical(uint64_t virt);
 
 // returns true if the virtual address is mapped, false otherwise
 bool vmm_is_mapped(uint64_t virt);
 
+void vmm_get_stats(vmm_stats_t* stats);
+
+// The vmm_map_*/vmm_unmap_* calls work on the current space. Kernel-half
+// mappings are shared, so they show up in every space
+
+// Returns a new space sharing the kernel half, or NULL when out of memory
+vmm_space_t* vmm_create_space(void);
+// Frees the space's own page tables; switches away first if it is current
+void vmm_destroy_space(vmm_space_t* space);
+// Returns a copy-on-write clone of the regions registered in src (see
+// vma.c), or NULL when out of memory. Mappings made outside a region are
+// not carried over
+vmm_space_t* vmm_clone_space(vmm_space_t* src);
+// Loads the space's tables, keeping its TLB entries when PCIDs are on
+void vmm_switch(vmm_space_t* space);
+vmm_space_t* vmm_get_current_space(void);
+vmm_space_t* vmm_get_kernel_space(void);
+
+// Turns PCID tagging on or off. Returns false if the CPU lacks it
+bool vmm_set_pcid(bool enable);
+
+// Same as vmm_unmap_range/vmm_get_physical, on any space. release may be
+// NULL
+void vmm_space_unmap_range(vmm_space_t* space, uint64_t virt, uint64_t len, vmm_release_t release);
+uint64_t vmm_space_get_physical(vmm_space_t* space, uint64_t virt);
+
+// Unmaps several ranges behind a single TLB flush, unless more frames go
+// to release than one batch holds
+void vmm_space_unmap_ranges(vmm_space_t* space, const vmm_range_t* ranges, uint32_t count,
+                            vmm_release_t release);
+
+// Maps the pages present in src's [virt, virt + len) at the same
+// addresses in dst. With cow set each frame gains a reference and
+// writable pages turn read-only with PT_COW in both spaces; otherwise the
+// frames are simply shared. Huge pages in src are split to 4 KB first
+bool vmm_space_copy_range(vmm_space_t* dst, vmm_space_t* src, uint64_t virt, uint64_t len, bool cow);
+
+// Gives the current space a private writable copy of the PT_COW page at
+// virt, or takes the frame over if no other space still shares it.
+// Returns false if virt is not a PT_COW page or no memory is available
+bool vmm_break_cow(uint64_t virt);
+
+// Head of the space's region list, owned by vma.c
+struct vm_area** vmm_space_areas(vmm_space_t* space);
+
+// True for addresses every space shares
+bool vmm_is_kernel_address(uint64_t virt);
+
 #endif // __VMM_H__